@@ -0,0 +1,104 @@
+/*
+Library for reading DDS238-4 W Wifi Smart meter (SM).
+Reading via Hardware Serial
+2020 (development with PlatformIO IDE for VSCode & esp8266 core)
+
+MIT License
+
+Copyright (c) 2020 Rodrigo González Zárate
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Journal of the energy counters in LittleFS, restored after a reboot or a power loss
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+#include <JSmartMeter238Journal.h>   //import JSmartMeter238Journal
+#include <SmartMeter238.h>           //import SmartMeter238 library
+
+//-----------------------------------------------------------------------
+
+// Only for debug purposes
+HardwareSerial &meter = Serial;
+HardwareSerial &debug = Serial1;
+
+//-----------------------------------------------------------------------
+
+#ifdef SM_ENABLE_DEBUG
+SmartMeter238 sm(meter, debug);   // config SmartMeter238 with debug
+#else
+SmartMeter238 sm(meter);   // config SmartMeter238
+#endif
+
+JSmartMeter238Journal journal(LittleFS, "/jsm");
+
+// Data storage
+SmartMeter238::smartMeterData smData;
+
+// Without a clock the time of the records continues from the last record (it must not decrease)
+uint32_t timeBase = 0;
+
+void setup() {
+    debug.begin(9600);   // Start Serial Debug
+
+    sm.begin();   // initialize SmartMeter238 communication
+
+    if (!LittleFS.begin()) {
+        debug.println("LittleFS not mounted");
+    }
+
+    LittleFS.mkdir("/jsm");
+
+    // Recover the index, a record torn by a power loss is cut
+    if (!journal.begin()) {
+        debug.println("Journal not recovered");
+    }
+
+    debug.print("Records = ");
+    debug.println(journal.count());
+
+    JSmartMeter238Journal::journalRecord record;
+
+    if (journal.last(record)) {
+        timeBase = record.time + 1;
+
+        journal.restore(smData);   // Last energy counters, before the first read of the meter
+
+        debug.print("Restored totalKWh = ");
+        debug.println(smData.measurementData.data.totalKWh);
+    }
+}
+
+void loop() {
+    // Only a successful read is journaled, after an error smData keeps the last (or restored) values
+    if (sm.getMeasurementData(&smData, false)) {
+        debug.print("totalKWh = ");
+        debug.println(smData.measurementData.data.totalKWh);
+
+        if (!journal.append(smData, timeBase + millis() / 1000)) {
+            debug.println("Journal not available");
+        }
+    } else {
+        debug.println("Meter not read, not journaled");
+    }
+
+    delay(10000);
+}
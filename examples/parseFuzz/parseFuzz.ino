@@ -0,0 +1,153 @@
+/*
+Library for reading DDS238-4 W Wifi Smart meter (SM).
+Reading via Hardware Serial
+2020 (development with PlatformIO IDE for VSCode & esp8266 core)
+
+MIT License
+
+Copyright (c) 2020 Rodrigo González Zárate
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// JSM_ENABLE_PARSE_STATS must be defined for the library (build_flags = -D JSM_ENABLE_PARSE_STATS)
+
+#include <Arduino.h>
+
+#include <JSmartMeter238.h>   //import JSmartMeter238 library
+#include <SmartMeter238.h>    //import SmartMeter238 library
+
+//-----------------------------------------------------------------------
+
+// Only for debug purposes
+HardwareSerial &meter = Serial;
+HardwareSerial &debug = Serial1;
+
+//-----------------------------------------------------------------------
+
+char payloadBuffer[JSM_JSON_BUFFER];   // Buffer Json data
+char inputBuffer[JSM_MAX_INPUT_LENGTH * 2];   // Fuzz input, also longer than the limit
+
+#ifdef SM_ENABLE_DEBUG
+SmartMeter238 sm(meter, debug);   // config SmartMeter238 with debug
+JSmartMeter238 jsm(sm, debug);    // config JSmartMeter238 with debug
+#else
+SmartMeter238 sm(meter);   // config SmartMeter238
+JSmartMeter238 jsm(sm);    // config JSmartMeter238
+#endif
+
+// Data storage
+SmartMeter238::smartMeterData smData;
+
+// Seeds for mutation, only commands without meter transaction so the time is only parse and serialize
+const char *seeds[] = {
+    "{\"cmd\":\"getEventData\"}",
+    "{\"cmd\":\"commandInvalid\",\"data\":{\"maxCurrentLimit\":50.00,\"maxVoltageLimit\":270,\"minVoltageLimit\":175}}",
+    "{\"cmd\":\"getEventData\",\"unknown\":\"skipped by the filter\",\"data\":{\"other\":[1,2,3]}}"};
+
+unsigned int fuzzInput() {
+    const unsigned int maxLength = sizeof(inputBuffer) - 1;
+    unsigned int len = 0;
+
+    switch (random(5)) {
+        case 0: {   // Random bytes
+            len = random(1, maxLength);
+
+            for (unsigned int i = 0; i < len; i++) {
+                inputBuffer[i] = random(1, 256);
+            }
+
+            break;
+        }
+        case 1: {   // Deep nesting
+            len = random(1, maxLength);
+
+            for (unsigned int i = 0; i < len; i++) {
+                inputBuffer[i] = (i % 2 == 0) ? '{' : '[';
+            }
+
+            break;
+        }
+        case 2: {   // Many keys
+            len = snprintf(inputBuffer, maxLength, "{");
+
+            while (len < maxLength - 8) {
+                len += snprintf(inputBuffer + len, maxLength - len, "\"k%u\":%u,", len, len);
+
+                if (len > maxLength) {
+                    len = maxLength;   // Truncated by snprintf
+                }
+            }
+
+            inputBuffer[len - 1] = '}';
+
+            break;
+        }
+        default: {   // Mutated seed
+            const char *seed = seeds[random(sizeof(seeds) / sizeof(seeds[0]))];
+
+            len = strlen(seed);
+            memcpy(inputBuffer, seed, len);
+
+            for (uint8_t i = random(4); i > 0; i--) {
+                inputBuffer[random(len)] = random(32, 127);
+            }
+        }
+    }
+
+    inputBuffer[len] = 0;
+
+    return len;
+}
+
+void printStats() {
+    const char *names[] = {"valid", "rejected early", "invalid json", "invalid command"};
+
+    for (uint8_t i = 0; i < JSmartMeter238::JSM_INPUT_CLASSES; i++) {
+        JSmartMeter238::jsmParseStats stats = jsm.getParseStats((JSmartMeter238::jsmInputClass)i);
+
+        debug.print(names[i]);
+        debug.print(": count = ");
+        debug.print(stats.count);
+        debug.print(" / worst us = ");
+        debug.println(stats.worstMicros);
+    }
+
+    debug.println();
+}
+
+void setup() {
+    debug.begin(9600);   // Start Serial Debug
+
+    sm.begin();   // initialize SmartMeter238 communication
+
+    jsm.begin(smData);   // initialize JSmartMeter238 communication
+}
+
+void loop() {
+    for (unsigned int i = 0; i < 1000; i++) {
+        unsigned int len = fuzzInput();
+
+        jsm.processCmdJson(payloadBuffer, inputBuffer, len);
+
+        yield();
+    }
+
+    printStats();
+}
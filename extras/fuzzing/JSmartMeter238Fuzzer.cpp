@@ -0,0 +1,171 @@
+/*
+Host fuzzing harness for the Json requests of JSmartMeter238 (libFuzzer).
+Fake meter and Arduino stand-ins in host/, the library is built unchanged.
+2020 (development with PlatformIO IDE for VSCode & esp8266 core)
+
+MIT License
+
+Copyright (c) 2020 Rodrigo González
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// libFuzzer (clang):
+//   clang++ -g -O1 -fsanitize=fuzzer,address,undefined -DJSM_ENABLE_PARSE_STATS -Ihost -I../../src -I<ArduinoJson>/src JSmartMeter238Fuzzer.cpp ../../src/JSmartMeter238.cpp -o jsmFuzzer
+//   ./jsmFuzzer corpus
+// Replay of the corpus or crashes (gcc or clang), add -DJSM_FUZZ_MAIN without -fsanitize=fuzzer:
+//   ./jsmFuzzer corpus/*
+// The count and worst-case time of each input class are printed at exit
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <JSmartMeter238.h>
+
+#ifndef JSM_ENABLE_PARSE_STATS
+#error "Build the harness with -DJSM_ENABLE_PARSE_STATS"
+#endif
+
+//------------------------------------------------------------------------------
+
+HardwareSerial Serial;
+
+unsigned long fuzzMillis = 0;   // Advanced by the input, for cache and rate limit
+
+unsigned long millis() {
+    return fuzzMillis;
+}
+
+unsigned long micros() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+void yield() {}
+
+void delay(unsigned long ms) {
+    fuzzMillis += ms;
+}
+
+char *dtostrf(double value, signed char width, unsigned char prec, char *buf) {
+    sprintf(buf, "%*.*f", width, prec, value);
+
+    return buf;
+}
+
+//------------------------------------------------------------------------------
+
+SmartMeter238 sm(Serial);
+JSmartMeter238 jsm(sm);
+
+SmartMeter238::smartMeterData smData;
+
+char payloadBuffer[JSM_JSON_BUFFER];
+
+void checkOutput(unsigned int len) {
+    // The output must fit in the buffer and be terminated
+    if (len >= JSM_JSON_BUFFER || strlen(payloadBuffer) != len) {
+        abort();
+    }
+}
+
+void printStats() {
+    const char *names[] = {"valid", "rejected early", "invalid json", "invalid command"};
+
+    for (uint8_t i = 0; i < JSmartMeter238::JSM_INPUT_CLASSES; i++) {
+        JSmartMeter238::jsmParseStats stats = jsm.getParseStats((JSmartMeter238::jsmInputClass)i);
+
+        printf("%s: count = %u / worst us = %u\n", names[i], stats.count, stats.worstMicros);
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static bool started = false;
+
+    if (!started) {
+        jsm.begin(smData);
+
+        jsm.setRateLimit(JSmartMeter238::JSM_CLASS_WRITE, 4, 1000);
+
+#ifndef JSM_FUZZ_MAIN
+        atexit(printStats);   // libFuzzer exits from its own main
+#endif
+
+        started = true;
+    }
+
+    if (size < 1) {
+        return 0;
+    }
+
+    // First byte: options, the rest is the request
+    uint8_t options = data[0];
+
+    jsm.setJsonCompact(options & 0x01);
+    jsm.setJsonPretty(options & 0x02);
+    jsm.setOutputFormat((JSmartMeter238::jsmOutputFormat)((options >> 2) % 3));
+
+    sm.fail = options & 0x10;
+    fuzzMillis += (options >> 5) * 250;
+
+    const char *json = (const char *)(data + 1);
+    unsigned int len = size - 1;
+
+    payloadBuffer[0] = 0;
+    checkOutput(jsm.processCmdJson(payloadBuffer, json, len, options >> 6));
+
+    if (jsm.queueCmdJson(json, len, options >> 6)) {
+        payloadBuffer[0] = 0;
+        checkOutput(jsm.processQueue(payloadBuffer));
+    }
+
+    payloadBuffer[0] = 0;
+    checkOutput(jsm.processEvents(payloadBuffer));
+
+    return 0;
+}
+
+#ifdef JSM_FUZZ_MAIN
+int main(int argc, char *argv[]) {
+    static uint8_t input[JSM_MAX_INPUT_LENGTH * 4];
+
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+
+        if (file == NULL) {
+            continue;
+        }
+
+        size_t size = fread(input, 1, sizeof(input), file);
+
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(input, size);
+
+        printf("%s: ok\n", argv[i]);
+    }
+
+    printStats();
+
+    return 0;
+}
+#endif   // JSM_FUZZ_MAIN
@@ -0,0 +1,22 @@
+// Host stand-in of the Arduino core, only what JSmartMeter238 uses (fuzzing)
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGMEM
+#define F(s) (s)
+#define FPSTR(p) ((const char *)(p))
+
+unsigned long millis();
+unsigned long micros();
+void yield();
+void delay(unsigned long ms);
+
+char *dtostrf(double value, signed char width, unsigned char prec, char *buf);
+
+#endif   // Arduino_h
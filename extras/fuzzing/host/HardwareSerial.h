@@ -0,0 +1,9 @@
+// Host stand-in, the fake meter does not use the serial port
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+class HardwareSerial {};
+
+extern HardwareSerial Serial;
+
+#endif   // HardwareSerial_h
@@ -0,0 +1,7 @@
+// Host stand-in, debug is not enabled for fuzzing
+#ifndef RemoteDebug_h
+#define RemoteDebug_h
+
+class RemoteDebug {};
+
+#endif   // RemoteDebug_h
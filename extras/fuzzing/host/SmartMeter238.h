@@ -0,0 +1,125 @@
+// Host stand-in of SmartMeter238: fake meter with the same data and commands, no serial port (fuzzing)
+#ifndef SmartMeter238_h
+#define SmartMeter238_h
+
+#include <Arduino.h>
+#include <HardwareSerial.h>
+
+#define SM_PRINT_E_LN(x)
+#define SM_PRINT_I_LN(x)
+#define SM_PRINT_V(x)
+#define SM_PRINT_V_LN(x)
+
+class SmartMeter238 {
+   public:
+    struct smartMeterData {
+        struct {
+            struct {
+                bool powerCut;
+                const char *powerCutDetails;
+                float delay;
+                bool delaySetPowerCut;
+            } data;
+        } powerCutData;
+
+        struct {
+            struct {
+                float current;
+                float voltage;
+                float frequency;
+                float reactivePower;
+                float activePower;
+                float powerFactor;
+                float lapseOfTimeTotalEnergy;
+                float lapseOfTimeImportEnergy;
+                float lapseOfTimeExportEnergy;
+                float lapseOfTimePriceEnergy;
+                float totalKWh;
+            } data;
+        } measurementData;
+
+        struct {
+            struct {
+                float maxCurrentLimit;
+                float maxVoltageLimit;
+                float minVoltageLimit;
+                float energyPurchase;
+                float energyPurchaseBalance;
+                float energyPurchaseAlarm;
+                bool energyPurchaseStatus;
+            } data;
+        } limitAndPurchaseData;
+
+        struct {
+            struct {
+                float startingKWh;
+                float priceKWh;
+            } data;
+        } powerCompanyData;
+    };
+
+    SmartMeter238(HardwareSerial &/*serial*/) {}
+
+    void begin() {}
+
+    bool fail = false;   // Meter error for the next commands
+
+    bool getPowerCutData(smartMeterData * /*data*/, bool /*print*/) { return !this->fail; }
+    bool getMeasurementData(smartMeterData *data, bool /*print*/) {
+        data->measurementData.data.voltage = 221.3;
+        data->measurementData.data.current = 1.202;
+        data->measurementData.data.activePower = 0.266;
+        data->measurementData.data.reactivePower = 0.012;
+
+        return !this->fail;
+    }
+    bool getLimitAndPurchaseData(smartMeterData * /*data*/, bool /*print*/) { return !this->fail; }
+    bool getPowerCompanyData(smartMeterData * /*data*/, bool /*print*/) { return !this->fail; }
+
+    bool setLimitsData(float maxCurrent, float maxVoltage, float minVoltage, smartMeterData *data) {
+        data->limitAndPurchaseData.data.maxCurrentLimit = maxCurrent;
+        data->limitAndPurchaseData.data.maxVoltageLimit = maxVoltage;
+        data->limitAndPurchaseData.data.minVoltageLimit = minVoltage;
+
+        return !this->fail;
+    }
+    bool setPurchaseData(float purchase, float alarm, bool status, smartMeterData *data) {
+        data->limitAndPurchaseData.data.energyPurchase = purchase;
+        data->limitAndPurchaseData.data.energyPurchaseBalance = purchase;
+        data->limitAndPurchaseData.data.energyPurchaseAlarm = alarm;
+        data->limitAndPurchaseData.data.energyPurchaseStatus = status;
+
+        return !this->fail;
+    }
+    bool setPowerCutData(bool powerCut, smartMeterData *data) {
+        data->powerCutData.data.powerCut = powerCut;
+
+        return !this->fail;
+    }
+    bool setDelay(bool set, float delay, smartMeterData *data) {
+        data->powerCutData.data.delaySetPowerCut = set;
+        data->powerCutData.data.delay = delay;
+
+        return !this->fail;
+    }
+    bool setReset(smartMeterData * /*data*/) { return !this->fail; }
+    bool setPowerCompanyData(float startingKWh, float priceKWh, smartMeterData *data) {
+        data->powerCompanyData.data.startingKWh = startingKWh;
+        data->powerCompanyData.data.priceKWh = priceKWh;
+
+        return !this->fail;
+    }
+
+    bool processIncomingMessages() { return !this->fail; }
+    bool sendHexMessage(const char * /*hex*/) { return !this->fail; }
+    const char *getIncomingHexMessage() { return ""; }
+
+    char *getTypeStr(bool /*clear*/) { return this->strType; }
+    char *getErrorStr(bool /*clear*/) { return this->strError; }
+
+   private:
+    char strType[16] = "Fake meter";
+    char strError[16] = "Fake error";
+};
+
+#endif   // SmartMeter238_h
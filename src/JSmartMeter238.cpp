@@ -46,30 +46,99 @@ JSmartMeter238::~JSmartMeter238() {}
 
 void JSmartMeter238::begin(SmartMeter238::smartMeterData &smartMeterData) {
     this->jsonSmartMeterData = &smartMeterData;
+
+    this->filter.clear();
+
+    this->filter["cmd"] = true;
+    this->filter["id"] = true;
+    this->filter["response"] = true;
+    this->filter["r"] = true;
+
+    this->headerFilter.clear();
+
+    this->headerFilter["cmd"] = true;
+    this->headerFilter["id"] = true;
+    this->headerFilter["response"] = true;
+    this->headerFilter["r"] = true;
+
+    JsonObject data = this->filter.createNestedObject("data");
+
+    data["maxCurrentLimit"] = true;
+    data["maxVoltageLimit"] = true;
+    data["minVoltageLimit"] = true;
+    data["energyPurchase"] = true;
+    data["energyPurchaseAlarm"] = true;
+    data["energyPurchaseStatus"] = true;
+    data["powerCut"] = true;
+    data["delaySetPowerCut"] = true;
+    data["delay"] = true;
+    data["startingKWh"] = true;
+    data["priceKWh"] = true;
+#ifdef SM_ENABLE_RAW_TEST_MSG
+    data["hex"] = true;
+#endif
+
+    if (this->filter.overflowed() || this->headerFilter.overflowed()) {
+        SM_PRINT_E_LN(F("* Json filter incomplete, increase JSM_JSON_FILTER_BUFFER."));   // Keys not in the filter are skipped
+    }
+
+#ifdef JSM_ENABLE_PARSE_STATS
+    this->clearParseStats();
+#endif   // JSM_ENABLE_PARSE_STATS
 }
 
 void JSmartMeter238::setJsonPretty(bool set) {
     this->jsonPretty = set;
 }
 
-unsigned int JSmartMeter238::processCmd(jsonCommands cmd, char destination[], const char *jsonData, unsigned int jsonLength) {
+void JSmartMeter238::setJsonCompact(bool set) {
+    this->jsonCompact = set;
+}
+
+void JSmartMeter238::setOutputFormat(jsmOutputFormat format) {
+    this->outputFormat = format;
+}
+
+void JSmartMeter238::setMeterTag(const char *tag) {
+    this->meterTag = tag;
+}
+
+unsigned int JSmartMeter238::processCmd(jsonCommands cmd, char destination[], const char *jsonData, unsigned int jsonLength, uint32_t clientId) {
     this->errType = JSM_TYPE_NO_ERROR;
     this->errCode = JSM_ERR_NO_ERROR;
 
+    this->requestId[0] = 0;
+
+    if (!this->admitCommand(cmd, clientId)) {
+        return this->serializeRejection(cmd, destination);
+    }
+
 	return this->processJSM(cmd, destination, jsonData, jsonLength, false);
 }
 
-unsigned int JSmartMeter238::processCmdJson(char destination[], const char *jsonData, unsigned int jsonLength) {
+unsigned int JSmartMeter238::processCmdJson(char destination[], const char *jsonData, unsigned int jsonLength, uint32_t clientId) {
+#ifdef JSM_ENABLE_PARSE_STATS
+    uint32_t start = micros();
+
+    jsmInputClass inputClass = JSM_INPUT_VALID;
+#endif   // JSM_ENABLE_PARSE_STATS
+
     this->errType = JSM_TYPE_NO_ERROR;
     this->errCode = JSM_ERR_NO_ERROR;
 
+    this->requestId[0] = 0;
+
 	jsonCommands cmd = this->invalidCmd;
 
-    this->deserializePayload(jsonData, jsonLength);	// Clean buffer doc and load json
+    this->deserializePayload(jsonData, jsonLength, true);	// Clean buffer doc and load json without "data"
+
+    if (this->responseInJson) {
+        return 0;   // Loop, a response of the library (detected before the limits)
+    }
 
 	if (this->errType == JSM_TYPE_NO_ERROR) {
 		// Check "response" (loop)
-		if (this->doc.containsKey("response")) {
+		if (this->doc.containsKey("response") || this->doc.containsKey("r")) {
 			return 0;
 		}
 
@@ -84,10 +153,53 @@ unsigned int JSmartMeter238::processCmdJson(char destination[], const char *json
 
 		if (sCmd != NULL) {
 			cmd = this->resolveCommand(sCmd);
+		} else if (this->doc["cmd"].is<int>()) {
+			cmd = this->resolveCommand(this->doc["cmd"].as<int>());   // Compact, numeric command
 		}
 	}
 
-	return this->processJSM(cmd, destination, "", 0, true);
+#ifdef JSM_ENABLE_PARSE_STATS
+    // Classify before processJSM, it clears the error
+    if (this->errCode == JSM_ERR_INPUT_TOO_LONG || this->errCode == JSM_ERR_TOO_MANY_KEYS || this->errCode == JSM_ERR_TOO_DEEP) {
+        inputClass = JSM_INPUT_REJECTED_EARLY;
+    } else if (this->errType != JSM_TYPE_NO_ERROR && this->errCode != JSM_ERR_COMMAND_NOT_IN_JSON) {
+        inputClass = JSM_INPUT_INVALID_JSON;
+    } else if (cmd == invalidCmd) {
+        inputClass = JSM_INPUT_INVALID_COMMAND;
+    }
+#endif   // JSM_ENABLE_PARSE_STATS
+
+	unsigned int tmpLen;
+
+    // Rejected before parse "data"
+    if (this->errType == JSM_TYPE_NO_ERROR && !this->admitCommand(cmd, clientId)) {
+        tmpLen = this->serializeRejection(cmd, destination);
+    } else {
+        // "data" only for the set commands, the input was checked by the first pass
+        if (this->errType == JSM_TYPE_NO_ERROR && this->commandClass(cmd) == JSM_CLASS_WRITE) {
+            this->deserializePayload(jsonData, jsonLength, false, true);
+
+#ifdef JSM_ENABLE_PARSE_STATS
+            if (this->errType != JSM_TYPE_NO_ERROR) {
+                inputClass = JSM_INPUT_INVALID_JSON;
+            }
+#endif   // JSM_ENABLE_PARSE_STATS
+        }
+
+        tmpLen = this->processJSM(cmd, destination, jsonData, jsonLength, true);
+    }
+
+#ifdef JSM_ENABLE_PARSE_STATS
+    uint32_t elapsed = micros() - start;
+
+    this->parseStats[inputClass].count++;
+
+    if (elapsed > this->parseStats[inputClass].worstMicros) {
+        this->parseStats[inputClass].worstMicros = elapsed;
+    }
+#endif   // JSM_ENABLE_PARSE_STATS
+
+	return tmpLen;
 }
 
 unsigned int JSmartMeter238::processJSM(jsonCommands cmd, char destination[], const char *jsonData, unsigned int jsonLength, bool cmdInJson) {
@@ -110,35 +222,60 @@ unsigned int JSmartMeter238::processJSM(jsonCommands cmd, char destination[], co
     const char *strErrType = "";
     const char *strErrDescription = "";
 
-    bool jsonError = false;
+    bool jsonError = this->errType != JSM_TYPE_NO_ERROR;   // Parse error of processCmdJson
     bool smError = false;
 
+    bool cached = this->isCached(cmd);   // Only for queued requests
+
+    // The meter writes in smartMeterData here, in the same task as the copy (the seqlock is only for writers outside the library)
+    jsmDataGroup updated = cached ? JSM_GROUPS : this->updateGroup(cmd);
+
     switch (cmd) {
         case getPowerCutData: {
-            smError = !this->smEnergyMeter.getPowerCutData(this->jsonSmartMeterData, false);
+            if (!cached) {
+                smError = !this->smEnergyMeter.getPowerCutData(this->jsonSmartMeterData, false);
+            }
 
             break;
         }
         case getMeasurementData: {
-            smError = !this->smEnergyMeter.getMeasurementData(this->jsonSmartMeterData, false);
+            if (!cached) {
+                smError = !this->smEnergyMeter.getMeasurementData(this->jsonSmartMeterData, false);
+            }
 
             break;
         }
         case getLimitData: {
-            smError = !this->smEnergyMeter.getLimitAndPurchaseData(this->jsonSmartMeterData, false);
+            if (!cached) {
+                smError = !this->smEnergyMeter.getLimitAndPurchaseData(this->jsonSmartMeterData, false);
+            }
 
             break;
         }
         case getPurchaseData: {
-            smError = !this->smEnergyMeter.getLimitAndPurchaseData(this->jsonSmartMeterData, false);
+            if (!cached) {
+                smError = !this->smEnergyMeter.getLimitAndPurchaseData(this->jsonSmartMeterData, false);
+            }
 
             break;
         }
         case getPowerCompanyData: {
-            smError = !this->smEnergyMeter.getPowerCompanyData(this->jsonSmartMeterData, false);
+            if (!cached) {
+                smError = !this->smEnergyMeter.getPowerCompanyData(this->jsonSmartMeterData, false);
+            }
 
             break;
         }
+        case getEventData: {
+            this->evaluateEvents();   // Data refreshed outside the library, the changes stay pending for processEvents
+
+            this->eventReport = JSM_EVENT_ALL;   // Report the current state
+
+            break;
+        }
+        case getDerivedData: {
+            break;   // Updated with each sample
+        }
 
         case setLimitsData: {
             if (!cmdInJson) {
@@ -315,8 +452,10 @@ unsigned int JSmartMeter238::processJSM(jsonCommands cmd, char destination[], co
         }
 #endif
         case invalidCmd: {
-            this->errType = JSM_TYPE_PARSE_JSON;
-            this->errCode = JSM_ERR_COMMAND_NOT_VALID;
+            if (this->errType == JSM_TYPE_NO_ERROR) {
+                this->errType = JSM_TYPE_PARSE_JSON;
+                this->errCode = JSM_ERR_COMMAND_NOT_VALID;
+            }
 
             jsonError = true;
 
@@ -329,14 +468,33 @@ unsigned int JSmartMeter238::processJSM(jsonCommands cmd, char destination[], co
         }
     }
 
-    if (jsonError || smError) {
-        if (jsonError) {
-            strErrType = this->getTypeStr(true);
-            strErrDescription = this->getErrorStr(true);
-        } else if (smError) {
-            strErrType = this->smEnergyMeter.getTypeStr(true);
-            strErrDescription = this->smEnergyMeter.getErrorStr(true);
-        }
+    jsmDataGroup group = this->dataGroup(cmd);
+
+    if (group != JSM_GROUPS && !cached) {
+        this->acquiredTime[group] = millis();
+        this->acquiredValid[group] = !smError;
+    } else if (group == JSM_GROUPS && updated != JSM_GROUPS) {
+        this->acquiredValid[updated] = false;   // Set command, the next get reads the meter
+    }
+
+    if (cmd == getMeasurementData && !cached && !smError) {
+        this->updateDerivedData();
+    }
+
+    if (group != JSM_GROUPS && !cached && !smError) {
+        this->evaluateEvents();   // Sent by processEvents
+    }
+
+    if (jsonError) {
+        // Serialized from errType and errCode
+        SM_PRINT_V(F("* Error:"));
+        SM_PRINT_V(F(" type = "));
+        SM_PRINT_V(FPSTR(jsmStrTypeTable[this->errType]));
+        SM_PRINT_V(F(" / description = "));
+        SM_PRINT_V_LN(FPSTR(jsmStrErrTable[this->errCode]));
+    } else if (smError) {
+        strErrType = this->smEnergyMeter.getTypeStr(true);
+        strErrDescription = this->smEnergyMeter.getErrorStr(true);
 
         SM_PRINT_V(F("* Error:"));
         SM_PRINT_V(F(" type = "));
@@ -345,7 +503,20 @@ unsigned int JSmartMeter238::processJSM(jsonCommands cmd, char destination[], co
         SM_PRINT_V_LN(strErrDescription);
     }
 
-    unsigned int tmpLen = this->serializePayload(cmd, strErrType, strErrDescription, destination);
+    unsigned int tmpLen;
+
+    this->takeSnapshot();
+
+    if (this->outputFormat != JSM_FORMAT_JSON && !jsonError && !smError && this->commandClass(cmd) == JSM_CLASS_READ) {
+        tmpLen = this->serializeMetrics(cmd, destination);
+    } else {
+        tmpLen = this->serializePayload(cmd, strErrType, strErrDescription, destination);   // set commands and errors always as Json
+    }
+
+    this->clearErrType();
+    this->clearErrCode();
+
+    this->requestId[0] = 0;
 
 #ifdef SM_ENABLE_RAW_TEST_MSG
     if (cmd != getRawMessage) {
@@ -358,102 +529,207 @@ unsigned int JSmartMeter238::processJSM(jsonCommands cmd, char destination[], co
     return tmpLen;
 }
 
-unsigned int JSmartMeter238::serializePayload(jsonCommands cmd, const char *strErrType, const char *strErrDescription, char destination[]) {
+void JSmartMeter238::serializeHeader(jsonCommands cmd) {
     this->doc.clear();
 
-    this->doc["response"] = this->commandToText(cmd);
-    this->doc["time"] = millis();
+    if (this->jsonCompact) {
+        this->doc["r"] = (int)cmd;
+    } else {
+        this->doc["response"] = this->commandToText(cmd);
+    }
+
+    if (this->requestId[0] != 0) {
+        if (this->requestIdIsNumber) {
+            this->doc[this->key("id", "i")] = serialized((const char *)this->requestId);
+        } else {
+            this->doc[this->key("id", "i")] = (const char *)this->requestId;
+        }
+    }
+
+    this->doc[this->key("time", "t")] = millis();
+}
+
+unsigned int JSmartMeter238::serializeRejection(jsonCommands cmd, char destination[]) {
+    this->errType = JSM_TYPE_ADMISSION;
+    this->errCode = JSM_ERR_RATE_LIMITED;
+
+    SM_PRINT_V(F("* Rejected: "));
+    SM_PRINT_V(this->commandToText(cmd));
+    SM_PRINT_V(F(" / retry after = "));
+    SM_PRINT_V_LN(this->retryAfter);
+
+    this->serializeHeader(cmd);
+
+    JsonObject error = this->doc.createNestedObject(this->key("error", "e"));
+
+    if (this->jsonCompact) {
+        error["c"] = (int)this->errCode;
+    } else {
+        error["type"] = FPSTR(jsmStrTypeTable[this->errType]);
+        error["description"] = FPSTR(jsmStrErrTable[this->errCode]);
+    }
+
+    error[this->key("retryAfter", "ra")] = this->retryAfter;
+
+    this->clearErrType();
+    this->clearErrCode();
+
+    this->requestId[0] = 0;
+
+    if (this->jsonPretty) {
+        return serializeJsonPretty(this->doc, destination, JSM_JSON_BUFFER);
+    }
+
+    return serializeJson(this->doc, destination, JSM_JSON_BUFFER);
+}
+
+unsigned int JSmartMeter238::serializePayload(jsonCommands cmd, const char *strErrType, const char *strErrDescription, char destination[]) {
+    this->serializeHeader(cmd);
 
     JsonObject data;
 
     switch (cmd) {
         case getPowerCutData: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["powerCut"] = this->jsonSmartMeterData->powerCutData.data.powerCut;
-            data["powerCutDetails"] = this->jsonSmartMeterData->powerCutData.data.powerCutDetails;
+            data[this->key("powerCut", "pc")] = this->snapshot.powerCutData.data.powerCut;
+            data[this->key("powerCutDetails", "pd")] = this->snapshot.powerCutData.data.powerCutDetails;
 
-            data["delay"] = this->jsonSmartMeterData->powerCutData.data.delay;
-            data["delaySetPowerCut"] = this->jsonSmartMeterData->powerCutData.data.delaySetPowerCut;
+            data[this->key("delay", "dl")] = this->snapshot.powerCutData.data.delay;
+            data[this->key("delaySetPowerCut", "ds")] = this->snapshot.powerCutData.data.delaySetPowerCut;
 
             break;
         }
         case getMeasurementData: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
+
+            data[this->key("current", "c")] = this->round(this->snapshot.measurementData.data.current, 3);
+            data[this->key("voltage", "v")] = this->round(this->snapshot.measurementData.data.voltage, 1);
+            data[this->key("frequency", "f")] = this->round(this->snapshot.measurementData.data.frequency, 2);
+
+            data[this->key("reactivePower", "q")] = this->round(this->snapshot.measurementData.data.reactivePower, 3);
+            data[this->key("activePower", "p")] = this->round(this->snapshot.measurementData.data.activePower, 3);
+            data[this->key("powerFactor", "pf")] = this->round(this->snapshot.measurementData.data.powerFactor, 2);
+
+            data[this->key("lapseOfTimeTotalEnergy", "lt")] = this->round(this->snapshot.measurementData.data.lapseOfTimeTotalEnergy, 2);
+            data[this->key("lapseOfTimeImportEnergy", "li")] = this->round(this->snapshot.measurementData.data.lapseOfTimeImportEnergy, 2);
+            data[this->key("lapseOfTimeExportEnergy", "le")] = this->round(this->snapshot.measurementData.data.lapseOfTimeExportEnergy, 2);
+            data[this->key("lapseOfTimePriceEnergy", "lp")] = this->round(this->snapshot.measurementData.data.lapseOfTimePriceEnergy, 1);
+
+            data[this->key("totalKWh", "k")] = this->round(this->snapshot.measurementData.data.totalKWh, 2);
+
+            break;
+        }
+
+        case getEventData: {
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["current"] = this->round(this->jsonSmartMeterData->measurementData.data.current, 3);
-            data["voltage"] = this->round(this->jsonSmartMeterData->measurementData.data.voltage, 1);
-            data["frequency"] = this->round(this->jsonSmartMeterData->measurementData.data.frequency, 2);
+            if (this->eventReport & (JSM_EVENT_OVER_VOLTAGE | JSM_EVENT_UNDER_VOLTAGE)) {
+                if (this->eventReport & JSM_EVENT_OVER_VOLTAGE) {
+                    data[this->key("overVoltage", "ov")] = (this->eventState & JSM_EVENT_OVER_VOLTAGE) != 0;
+                }
+
+                if (this->eventReport & JSM_EVENT_UNDER_VOLTAGE) {
+                    data[this->key("underVoltage", "uv")] = (this->eventState & JSM_EVENT_UNDER_VOLTAGE) != 0;
+                }
+
+                data[this->key("voltage", "v")] = this->round(this->snapshot.measurementData.data.voltage, 1);
+            }
+
+            if (this->eventReport & JSM_EVENT_OVER_CURRENT) {
+                data[this->key("overCurrent", "oc")] = (this->eventState & JSM_EVENT_OVER_CURRENT) != 0;
+                data[this->key("current", "c")] = this->round(this->snapshot.measurementData.data.current, 3);
+            }
+
+            if (this->eventReport & JSM_EVENT_BALANCE_ALARM) {
+                data[this->key("balanceAlarm", "ba")] = (this->eventState & JSM_EVENT_BALANCE_ALARM) != 0;
+                data[this->key("energyPurchaseBalance", "eb")] = this->round(this->snapshot.limitAndPurchaseData.data.energyPurchaseBalance, 2);
+            }
+
+            if (this->eventReport & JSM_EVENT_POWER_CUT) {
+                data[this->key("powerCut", "pc")] = (this->eventState & JSM_EVENT_POWER_CUT) != 0;
+                data[this->key("powerCutDetails", "pd")] = this->snapshot.powerCutData.data.powerCutDetails;
+            }
+
+            break;
+        }
+
+        case getDerivedData: {
+            data = this->doc.createNestedObject(this->key("data", "d"));
+
+            data[this->key("apparentPower", "s")] = this->round(this->apparentPower, 3);
+            data[this->key("costRate", "cr")] = this->round(this->costRate, 2);
 
-            data["reactivePower"] = this->round(this->jsonSmartMeterData->measurementData.data.reactivePower, 3);
-            data["activePower"] = this->round(this->jsonSmartMeterData->measurementData.data.activePower, 3);
-            data["powerFactor"] = this->round(this->jsonSmartMeterData->measurementData.data.powerFactor, 2);
+            data[this->key("activePowerAverage", "pa")] = this->round(this->averagePower, 3);
+            data[this->key("activePowerWindow", "pw")] = this->round(this->windowPower, 3);
 
-            data["lapseOfTimeTotalEnergy"] = this->round(this->jsonSmartMeterData->measurementData.data.lapseOfTimeTotalEnergy, 2);
-            data["lapseOfTimeImportEnergy"] = this->round(this->jsonSmartMeterData->measurementData.data.lapseOfTimeImportEnergy, 2);
-            data["lapseOfTimeExportEnergy"] = this->round(this->jsonSmartMeterData->measurementData.data.lapseOfTimeExportEnergy, 2);
-            data["lapseOfTimePriceEnergy"] = this->round(this->jsonSmartMeterData->measurementData.data.lapseOfTimePriceEnergy, 1);
+            data[this->key("peakDemand", "dp")] = this->round(this->peakDemand, 3);
+            data[this->key("peakDemandTime", "dt")] = this->peakDemandTime;
 
-            data["totalKWh"] = this->round(this->jsonSmartMeterData->measurementData.data.totalKWh, 2);
+            if (this->balanceTime >= 0) {
+                data[this->key("balanceTime", "bt")] = this->round(this->balanceTime, 1);
+            }
+
+            data[this->key("samples", "n")] = this->derivedSamples;
 
             break;
         }
 
         case getLimitData:
         case setLimitsData: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["maxCurrentLimit"] = this->jsonSmartMeterData->limitAndPurchaseData.data.maxCurrentLimit;
-            data["maxVoltageLimit"] = this->jsonSmartMeterData->limitAndPurchaseData.data.maxVoltageLimit;
-            data["minVoltageLimit"] = this->jsonSmartMeterData->limitAndPurchaseData.data.minVoltageLimit;
+            data[this->key("maxCurrentLimit", "mc")] = this->snapshot.limitAndPurchaseData.data.maxCurrentLimit;
+            data[this->key("maxVoltageLimit", "mv")] = this->snapshot.limitAndPurchaseData.data.maxVoltageLimit;
+            data[this->key("minVoltageLimit", "nv")] = this->snapshot.limitAndPurchaseData.data.minVoltageLimit;
 
             break;
         }
         case getPurchaseData:
         case setPurchaseData: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["energyPurchase"] = this->round(this->jsonSmartMeterData->limitAndPurchaseData.data.energyPurchase, 2);
-            data["energyPurchaseBalance"] = this->round(this->jsonSmartMeterData->limitAndPurchaseData.data.energyPurchaseBalance, 2);
-            data["energyPurchaseAlarm"] = this->round(this->jsonSmartMeterData->limitAndPurchaseData.data.energyPurchaseAlarm, 2);
-            data["energyPurchaseStatus"] = this->jsonSmartMeterData->limitAndPurchaseData.data.energyPurchaseStatus;
+            data[this->key("energyPurchase", "ep")] = this->round(this->snapshot.limitAndPurchaseData.data.energyPurchase, 2);
+            data[this->key("energyPurchaseBalance", "eb")] = this->round(this->snapshot.limitAndPurchaseData.data.energyPurchaseBalance, 2);
+            data[this->key("energyPurchaseAlarm", "ea")] = this->round(this->snapshot.limitAndPurchaseData.data.energyPurchaseAlarm, 2);
+            data[this->key("energyPurchaseStatus", "es")] = this->snapshot.limitAndPurchaseData.data.energyPurchaseStatus;
 
             break;
         }
         case setPowerCutData: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["powerCut"] = this->jsonSmartMeterData->powerCutData.data.powerCut;
-            data["powerCutDetails"] = this->jsonSmartMeterData->powerCutData.data.powerCutDetails;
+            data[this->key("powerCut", "pc")] = this->snapshot.powerCutData.data.powerCut;
+            data[this->key("powerCutDetails", "pd")] = this->snapshot.powerCutData.data.powerCutDetails;
 
             break;
         }
         case setDelay: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["delay"] = this->jsonSmartMeterData->powerCutData.data.delay;
-            data["delaySetPowerCut"] = this->jsonSmartMeterData->powerCutData.data.delaySetPowerCut;
+            data[this->key("delay", "dl")] = this->snapshot.powerCutData.data.delay;
+            data[this->key("delaySetPowerCut", "ds")] = this->snapshot.powerCutData.data.delaySetPowerCut;
 
             break;
         }
         case setReset: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["lapseOfTimeTotalEnergy"] = this->round(this->jsonSmartMeterData->measurementData.data.lapseOfTimeTotalEnergy, 2);
-            data["lapseOfTimeImportEnergy"] = this->round(this->jsonSmartMeterData->measurementData.data.lapseOfTimeImportEnergy, 2);
-            data["lapseOfTimeExportEnergy"] = this->round(this->jsonSmartMeterData->measurementData.data.lapseOfTimeExportEnergy, 2);
-            data["lapseOfTimePriceEnergy"] = this->round(this->jsonSmartMeterData->measurementData.data.lapseOfTimePriceEnergy, 2);
+            data[this->key("lapseOfTimeTotalEnergy", "lt")] = this->round(this->snapshot.measurementData.data.lapseOfTimeTotalEnergy, 2);
+            data[this->key("lapseOfTimeImportEnergy", "li")] = this->round(this->snapshot.measurementData.data.lapseOfTimeImportEnergy, 2);
+            data[this->key("lapseOfTimeExportEnergy", "le")] = this->round(this->snapshot.measurementData.data.lapseOfTimeExportEnergy, 2);
+            data[this->key("lapseOfTimePriceEnergy", "lp")] = this->round(this->snapshot.measurementData.data.lapseOfTimePriceEnergy, 2);
 
-            data["totalKWh"] = this->round(this->jsonSmartMeterData->measurementData.data.totalKWh, 2);
+            data[this->key("totalKWh", "k")] = this->round(this->snapshot.measurementData.data.totalKWh, 2);
 
             break;
         }
         case getPowerCompanyData:
         case setPowerCompanyData: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["startingKWh"] = this->round(this->jsonSmartMeterData->powerCompanyData.data.startingKWh, 2);
-            data["priceKWh"] = this->round(this->jsonSmartMeterData->powerCompanyData.data.priceKWh, 2);
+            data[this->key("startingKWh", "sk")] = this->round(this->snapshot.powerCompanyData.data.startingKWh, 2);
+            data[this->key("priceKWh", "pk")] = this->round(this->snapshot.powerCompanyData.data.priceKWh, 2);
 
             break;
         }
@@ -462,9 +738,9 @@ unsigned int JSmartMeter238::serializePayload(jsonCommands cmd, const char *strE
             const char *tmpStr = this->smEnergyMeter.getIncomingHexMessage();
 
             if (strlen(tmpStr) > 0) {
-                data = this->doc.createNestedObject("data");
+                data = this->doc.createNestedObject(this->key("data", "d"));
 
-                data["hex"] = tmpStr;
+                data[this->key("hex", "h")] = tmpStr;
             } else {
                 return 0;   // It is necessary to return 0, if there are no messages. This function is constantly called.
             }
@@ -472,9 +748,9 @@ unsigned int JSmartMeter238::serializePayload(jsonCommands cmd, const char *strE
             break;
         }
         case sendRawMessage: {
-            data = this->doc.createNestedObject("data");
+            data = this->doc.createNestedObject(this->key("data", "d"));
 
-            data["hex"] = this->smEnergyMeter.getIncomingHexMessage();   // Get response for command send, save in getHexMessage()
+            data[this->key("hex", "h")] = this->smEnergyMeter.getIncomingHexMessage();   // Get response for command send, save in getHexMessage()
 
             break;
         }
@@ -489,11 +765,21 @@ unsigned int JSmartMeter238::serializePayload(jsonCommands cmd, const char *strE
 
     JsonObject error;
 
-    if (strlen(strErrType) > 0 && strlen(strErrDescription) > 0) {
-        error = this->doc.createNestedObject("error");
+    if (this->errType != JSM_TYPE_NO_ERROR) {
+        error = this->doc.createNestedObject(this->key("error", "e"));
+
+        // Text straight from flash
+        if (this->jsonCompact) {
+            error["c"] = (int)this->errCode;
+        } else {
+            error["type"] = FPSTR(jsmStrTypeTable[this->errType]);
+            error["description"] = FPSTR(jsmStrErrTable[this->errCode]);
+        }
+    } else if (strlen(strErrType) > 0 && strlen(strErrDescription) > 0) {
+        error = this->doc.createNestedObject(this->key("error", "e"));   // Error of SmartMeter238
 
-        error["type"] = strErrType;
-        error["description"] = strErrDescription;
+        error[this->key("type", "y")] = strErrType;
+        error[this->key("description", "m")] = strErrDescription;
     }
 
     if (this->jsonPretty) {
@@ -503,9 +789,289 @@ unsigned int JSmartMeter238::serializePayload(jsonCommands cmd, const char *strE
     return serializeJson(this->doc, destination, JSM_JSON_BUFFER);
 }
 
-bool JSmartMeter238::deserializePayload(const char *jsonData, unsigned int jsonLength) {
-    // Clean buffer doc and load json
-    DeserializationError error = deserializeJson(this->doc, jsonData, jsonLength);
+unsigned int JSmartMeter238::serializeMetrics(jsonCommands cmd, char destination[]) {
+    unsigned int len = 0;
+    bool ok = true;
+
+    destination[0] = 0;
+
+    switch (cmd) {
+        case getPowerCutData: {
+            ok = ok && this->writeMetric(destination, len, "powerCut", this->snapshot.powerCutData.data.powerCut);
+            ok = ok && this->writeMetricText(destination, len, "powerCutDetails", this->snapshot.powerCutData.data.powerCutDetails);
+
+            ok = ok && this->writeMetric(destination, len, "delay", this->snapshot.powerCutData.data.delay);
+            ok = ok && this->writeMetric(destination, len, "delaySetPowerCut", this->snapshot.powerCutData.data.delaySetPowerCut);
+
+            break;
+        }
+        case getMeasurementData: {
+            ok = ok && this->writeMetric(destination, len, "current", this->round(this->snapshot.measurementData.data.current, 3));
+            ok = ok && this->writeMetric(destination, len, "voltage", this->round(this->snapshot.measurementData.data.voltage, 1));
+            ok = ok && this->writeMetric(destination, len, "frequency", this->round(this->snapshot.measurementData.data.frequency, 2));
+
+            ok = ok && this->writeMetric(destination, len, "reactivePower", this->round(this->snapshot.measurementData.data.reactivePower, 3));
+            ok = ok && this->writeMetric(destination, len, "activePower", this->round(this->snapshot.measurementData.data.activePower, 3));
+            ok = ok && this->writeMetric(destination, len, "powerFactor", this->round(this->snapshot.measurementData.data.powerFactor, 2));
+
+            ok = ok && this->writeMetric(destination, len, "lapseOfTimeTotalEnergy", this->round(this->snapshot.measurementData.data.lapseOfTimeTotalEnergy, 2));
+            ok = ok && this->writeMetric(destination, len, "lapseOfTimeImportEnergy", this->round(this->snapshot.measurementData.data.lapseOfTimeImportEnergy, 2));
+            ok = ok && this->writeMetric(destination, len, "lapseOfTimeExportEnergy", this->round(this->snapshot.measurementData.data.lapseOfTimeExportEnergy, 2));
+            ok = ok && this->writeMetric(destination, len, "lapseOfTimePriceEnergy", this->round(this->snapshot.measurementData.data.lapseOfTimePriceEnergy, 1));
+
+            ok = ok && this->writeMetric(destination, len, "totalKWh", this->round(this->snapshot.measurementData.data.totalKWh, 2));
+
+            break;
+        }
+        case getLimitData: {
+            ok = ok && this->writeMetric(destination, len, "maxCurrentLimit", this->snapshot.limitAndPurchaseData.data.maxCurrentLimit);
+            ok = ok && this->writeMetric(destination, len, "maxVoltageLimit", this->snapshot.limitAndPurchaseData.data.maxVoltageLimit);
+            ok = ok && this->writeMetric(destination, len, "minVoltageLimit", this->snapshot.limitAndPurchaseData.data.minVoltageLimit);
+
+            break;
+        }
+        case getPurchaseData: {
+            ok = ok && this->writeMetric(destination, len, "energyPurchase", this->round(this->snapshot.limitAndPurchaseData.data.energyPurchase, 2));
+            ok = ok && this->writeMetric(destination, len, "energyPurchaseBalance", this->round(this->snapshot.limitAndPurchaseData.data.energyPurchaseBalance, 2));
+            ok = ok && this->writeMetric(destination, len, "energyPurchaseAlarm", this->round(this->snapshot.limitAndPurchaseData.data.energyPurchaseAlarm, 2));
+            ok = ok && this->writeMetric(destination, len, "energyPurchaseStatus", this->snapshot.limitAndPurchaseData.data.energyPurchaseStatus);
+
+            break;
+        }
+        case getPowerCompanyData: {
+            ok = ok && this->writeMetric(destination, len, "startingKWh", this->round(this->snapshot.powerCompanyData.data.startingKWh, 2));
+            ok = ok && this->writeMetric(destination, len, "priceKWh", this->round(this->snapshot.powerCompanyData.data.priceKWh, 2));
+
+            break;
+        }
+        case getDerivedData: {
+            ok = ok && this->writeMetric(destination, len, "apparentPower", this->round(this->apparentPower, 3));
+            ok = ok && this->writeMetric(destination, len, "costRate", this->round(this->costRate, 2));
+
+            ok = ok && this->writeMetric(destination, len, "activePowerAverage", this->round(this->averagePower, 3));
+            ok = ok && this->writeMetric(destination, len, "activePowerWindow", this->round(this->windowPower, 3));
+
+            ok = ok && this->writeMetric(destination, len, "peakDemand", this->round(this->peakDemand, 3));
+
+            if (this->balanceTime >= 0) {
+                ok = ok && this->writeMetric(destination, len, "balanceTime", this->round(this->balanceTime, 1));
+            }
+
+            break;
+        }
+        case getEventData: {
+            ok = ok && this->writeMetric(destination, len, "overVoltage", (this->eventState & JSM_EVENT_OVER_VOLTAGE) != 0);
+            ok = ok && this->writeMetric(destination, len, "underVoltage", (this->eventState & JSM_EVENT_UNDER_VOLTAGE) != 0);
+            ok = ok && this->writeMetric(destination, len, "overCurrent", (this->eventState & JSM_EVENT_OVER_CURRENT) != 0);
+            ok = ok && this->writeMetric(destination, len, "balanceAlarm", (this->eventState & JSM_EVENT_BALANCE_ALARM) != 0);
+            ok = ok && this->writeMetric(destination, len, "powerCut", (this->eventState & JSM_EVENT_POWER_CUT) != 0);
+
+            break;
+        }
+        default: {
+            return 0;
+        }
+    }
+
+    if (ok) {
+        int n = snprintf(destination + len, JSM_JSON_BUFFER - len, (this->outputFormat == JSM_FORMAT_INFLUX) ? "\n" : "# EOF\n");
+
+        ok = n > 0 && (unsigned int)n < JSM_JSON_BUFFER - len;
+        len += n;
+    }
+
+    if (!ok) {
+        SM_PRINT_E_LN(F("* Small buffer for metrics, increase JSM_JSON_BUFFER."));
+
+        destination[0] = 0;
+
+        return 0;
+    }
+
+    return len;
+}
+
+bool JSmartMeter238::writeMetric(char destination[], unsigned int &len, const char *name, const char *value) {
+    int n;
+
+    if (this->outputFormat == JSM_FORMAT_INFLUX) {
+        // smartMeter238,meter=<tag> name=value,name=value
+        if (len == 0) {
+            n = snprintf(destination, JSM_JSON_BUFFER, "smartMeter238,meter=%s %s=%s", this->meterTag, name, value);
+        } else {
+            n = snprintf(destination + len, JSM_JSON_BUFFER - len, ",%s=%s", name, value);
+        }
+    } else {
+        // jsm_name{meter="<tag>"} value
+        n = snprintf(destination + len, JSM_JSON_BUFFER - len, "jsm_%s{meter=\"%s\"} %s\n", name, this->meterTag, value);
+    }
+
+    if (n < 0 || (unsigned int)n >= JSM_JSON_BUFFER - len) {
+        return false;
+    }
+
+    len += n;
+
+    return true;
+}
+
+bool JSmartMeter238::writeMetric(char destination[], unsigned int &len, const char *name, float value) {
+    char text[16];
+
+    snprintf(text, sizeof(text), "%g", value);   // Not rounded, as in Json
+
+    return this->writeMetric(destination, len, name, text);
+}
+
+bool JSmartMeter238::writeMetric(char destination[], unsigned int &len, const char *name, bool value) {
+    if (this->outputFormat == JSM_FORMAT_INFLUX) {
+        return this->writeMetric(destination, len, name, value ? "true" : "false");
+    }
+
+    return this->writeMetric(destination, len, name, value ? "1" : "0");
+}
+
+bool JSmartMeter238::writeMetricText(char destination[], unsigned int &len, const char *name, const char *value) {
+    if (this->outputFormat != JSM_FORMAT_INFLUX) {
+        return true;   // OpenMetrics has no text values
+    }
+
+    char text[48];
+    uint8_t n = 0;
+
+    text[n++] = '"';
+
+    for (uint8_t i = 0; value[i] != 0 && n < sizeof(text) - 3; i++) {
+        if (value[i] == '"' || value[i] == '\\') {
+            text[n++] = '\\';
+        }
+
+        text[n++] = value[i];
+    }
+
+    text[n++] = '"';
+    text[n] = 0;
+
+    return this->writeMetric(destination, len, name, text);
+}
+
+bool JSmartMeter238::checkPayload(const char *jsonData, unsigned int jsonLength) {
+    // One pass over the input, reject before the parser uses the doc
+    this->responseInJson = false;
+
+    uint8_t depth = 0;
+    uint8_t keys = 0;
+
+    bool inString = false;
+    bool escape = false;
+
+    bool topObject = false;
+    bool firstKey = true;
+    unsigned int keyStart = 0;
+
+    for (unsigned int i = 0; i < jsonLength && jsonData[i] != 0; i++) {
+        // Checked here, the first key is read before (a response of the library can be longer)
+        if (i >= JSM_MAX_INPUT_LENGTH) {
+            this->errType = JSM_TYPE_PARSE_JSON;
+            this->errCode = JSM_ERR_INPUT_TOO_LONG;
+
+            return false;
+        }
+
+        char c = jsonData[i];
+
+        if (inString) {
+            if (escape) {
+                escape = false;
+            } else if (c == '\\') {
+                escape = true;
+            } else if (c == '"') {
+                inString = false;
+
+                // "response" or "r" is the first key of the responses (loop), dropped without error
+                if (keyStart > 0) {
+                    unsigned int keyLength = i - keyStart;
+
+                    if ((keyLength == 8 && strncmp(jsonData + keyStart, "response", 8) == 0) || (keyLength == 1 && jsonData[keyStart] == 'r')) {
+                        this->responseInJson = true;
+
+                        return false;
+                    }
+
+                    keyStart = 0;
+                }
+            }
+
+            continue;
+        }
+
+        switch (c) {
+            case '"': {
+                inString = true;
+
+                if (firstKey && topObject && depth == 1) {
+                    keyStart = i + 1;
+                    firstKey = false;
+                }
+
+                break;
+            }
+            case '{':
+            case '[': {
+                if (depth == 0) {
+                    topObject = c == '{';
+                }
+
+                if (++depth > JSM_MAX_DEPTH) {
+                    this->errType = JSM_TYPE_PARSE_JSON;
+                    this->errCode = JSM_ERR_TOO_DEEP;
+
+                    return false;
+                }
+
+                break;
+            }
+            case '}':
+            case ']': {
+                if (depth > 0) {
+                    depth--;
+                }
+
+                break;
+            }
+            case ':': {
+                if (++keys > JSM_MAX_KEYS) {
+                    this->errType = JSM_TYPE_PARSE_JSON;
+                    this->errCode = JSM_ERR_TOO_MANY_KEYS;
+
+                    return false;
+                }
+
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool JSmartMeter238::deserializePayload(const char *jsonData, unsigned int jsonLength, bool header, bool checked) {
+    this->doc.clear();
+
+    if (!checked && !this->checkPayload(jsonData, jsonLength)) {
+        // A response is only a loop for processCmdJson (header), else the data is not valid input
+        if (this->responseInJson && !header) {
+            this->errType = JSM_TYPE_PARSE_JSON;
+            this->errCode = JSM_ERR_INVALID_INPUT;
+        }
+
+        return false;
+    }
+
+    // Clean buffer doc and load json, unknown keys are skipped without allocation
+    JsonDocument &keys = header ? static_cast<JsonDocument &>(this->headerFilter) : static_cast<JsonDocument &>(this->filter);
+
+    DeserializationError error = deserializeJson(this->doc, jsonData, jsonLength, DeserializationOption::Filter(keys), DeserializationOption::NestingLimit(JSM_MAX_DEPTH));
 
     // Check valid Json
     if (error) {
@@ -543,11 +1109,554 @@ bool JSmartMeter238::deserializePayload(const char *jsonData, unsigned int jsonL
         }
     }
 
-    return !error;
-}
+    if (error) {
+        return false;
+    }
 
-JSmartMeter238::jsonCommands JSmartMeter238::resolveCommand(const char *cmd) {
-    if (strcmp(cmd, this->strGetPowerCutData) == 0)
+    if (!this->captureRequestId()) {
+        this->errType = JSM_TYPE_PARSE_JSON;
+        this->errCode = JSM_ERR_ID_NOT_VALID;
+
+        return false;
+    }
+
+    return true;
+}
+
+bool JSmartMeter238::captureRequestId() {
+    JsonVariant id = this->doc["id"];
+
+    if (id.isNull()) {
+        return true;
+    }
+
+    // Echoed unchanged or rejected, a truncated or rounded id would not match the request
+    if (id.is<const char *>()) {
+        const char *sId = id.as<const char *>();
+
+        if (strlen(sId) >= JSM_MAX_ID_LENGTH) {
+            return false;
+        }
+
+        strcpy(this->requestId, sId);
+
+        this->requestIdIsNumber = false;
+    } else if (id.is<long>()) {
+        snprintf(this->requestId, JSM_MAX_ID_LENGTH, "%ld", id.as<long>());
+
+        this->requestIdIsNumber = true;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool JSmartMeter238::queueCmdJson(const char *jsonData, unsigned int jsonLength, uint32_t clientId) {
+    if (jsonLength > JSM_MAX_INPUT_LENGTH) {
+        return false;   // Call processCmdJson to get the error
+    }
+
+    if (this->outputFormat != JSM_FORMAT_JSON) {
+        return false;   // Metrics have no "id" to match responses out of order
+    }
+
+    for (uint8_t i = 0; i < JSM_QUEUE_SIZE; i++) {
+        if (!this->queue[i].used) {
+            memcpy(this->queue[i].json, jsonData, jsonLength);
+            this->queue[i].json[jsonLength] = 0;
+
+            this->queue[i].length = jsonLength;
+            this->queue[i].clientId = clientId;
+            this->queue[i].order = this->queueOrder++;
+            this->queue[i].used = true;
+
+            // Resolve now, the command decides the order of the processing
+            this->queue[i].cmd = this->invalidCmd;
+
+            if (this->deserializePayload(jsonData, jsonLength, true)) {
+                const char *sCmd = this->doc["cmd"].as<const char *>();
+
+                if (sCmd != NULL) {
+                    this->queue[i].cmd = this->resolveCommand(sCmd);
+                } else if (this->doc["cmd"].is<int>()) {
+                    this->queue[i].cmd = this->resolveCommand(this->doc["cmd"].as<int>());
+                }
+            }
+
+            this->errType = JSM_TYPE_NO_ERROR;
+            this->errCode = JSM_ERR_NO_ERROR;
+
+            this->requestId[0] = 0;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+unsigned int JSmartMeter238::processQueue(char destination[]) {
+    int8_t next = -1;
+    bool nextCached = false;
+
+    // First the get commands that can be served from the last read, then the oldest
+    for (uint8_t i = 0; i < JSM_QUEUE_SIZE; i++) {
+        if (!this->queue[i].used) {
+            continue;
+        }
+
+        this->cacheEnabled = this->outputFormat == JSM_FORMAT_JSON;   // In order if the format changed after queue
+        bool cached = this->isCached(this->queue[i].cmd);
+        this->cacheEnabled = false;
+
+        // Not before an older set of the same data, the read would be older than the set
+        for (uint8_t j = 0; j < JSM_QUEUE_SIZE && cached; j++) {
+            if (this->queue[j].used && (int32_t)(this->queue[j].order - this->queue[i].order) < 0 && this->dataGroup(this->queue[j].cmd) == JSM_GROUPS && this->updateGroup(this->queue[j].cmd) == this->dataGroup(this->queue[i].cmd)) {
+                cached = false;
+            }
+        }
+
+        if (next < 0 || (cached && !nextCached) || (cached == nextCached && (int32_t)(this->queue[i].order - this->queue[next].order) < 0)) {
+            next = i;
+            nextCached = cached;
+        }
+    }
+
+    if (next < 0) {
+        return 0;
+    }
+
+    this->cacheEnabled = true;
+
+    unsigned int tmpLen = this->processCmdJson(destination, this->queue[next].json, this->queue[next].length, this->queue[next].clientId);
+
+    this->cacheEnabled = false;
+
+    this->queue[next].used = false;
+
+    return tmpLen;
+}
+
+uint8_t JSmartMeter238::queueCount() {
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < JSM_QUEUE_SIZE; i++) {
+        if (this->queue[i].used) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void JSmartMeter238::setRateLimit(jsmCommandClass commandClass, uint16_t burst, uint32_t refillTime) {
+    if (commandClass >= JSM_CLASSES) {
+        return;
+    }
+
+    this->rateLimit[commandClass].burst = burst;
+    this->rateLimit[commandClass].refillTime = refillTime;
+
+    this->sharedBucket.tokens[commandClass] = burst;
+    this->sharedBucket.refillStart[commandClass] = millis();
+}
+
+JSmartMeter238::jsmCommandClass JSmartMeter238::commandClass(jsonCommands cmd) {
+    switch (cmd) {
+        case getPowerCutData:
+        case getMeasurementData:
+        case getLimitData:
+        case getPurchaseData:
+        case getPowerCompanyData:
+        case getEventData:
+        case getDerivedData:
+            return JSM_CLASS_READ;
+        case setLimitsData:
+        case setPurchaseData:
+        case setPowerCutData:
+        case setDelay:
+        case setPowerCompanyData:
+#ifdef SM_ENABLE_RAW_TEST_MSG
+        case sendRawMessage:
+#endif
+            return JSM_CLASS_WRITE;
+        case setReset:
+            return JSM_CLASS_RESET;
+        default:
+            return JSM_CLASSES;   // getRawMessage too, polled in every loop
+    }
+}
+
+bool JSmartMeter238::admitCommand(jsonCommands cmd, uint32_t clientId) {
+    jsmCommandClass commandClass = this->commandClass(cmd);
+
+    if (commandClass == JSM_CLASSES || this->rateLimit[commandClass].burst == 0 || this->rateLimit[commandClass].refillTime == 0) {
+        return true;
+    }
+
+    uint32_t now = millis();
+
+    // Find the client, or a free slot: unused, or idle with all its buckets full again (no state is lost)
+    int8_t found = -1;
+    int8_t slot = -1;
+
+    for (uint8_t i = 0; i < JSM_MAX_CLIENTS; i++) {
+        if (this->clientBucket[i].used && this->clientBucket[i].clientId == clientId) {
+            found = i;
+
+            break;
+        }
+
+        if (slot < 0 && (!this->clientBucket[i].used || this->bucketIdle(this->clientBucket[i], now))) {
+            slot = i;
+        }
+    }
+
+    if (found < 0 && slot >= 0) {
+        found = slot;
+
+        this->clientBucket[found].used = true;
+        this->clientBucket[found].clientId = clientId;
+
+        for (uint8_t i = 0; i < JSM_CLASSES; i++) {
+            this->clientBucket[found].tokens[i] = this->rateLimit[i].burst;
+            this->clientBucket[found].refillStart[i] = now;
+        }
+    }
+
+    // Table full of active clients, the new ones share a bucket (a new clientId does not get a new burst)
+    jsmClientBucket &bucket = (found >= 0) ? this->clientBucket[found] : this->sharedBucket;
+
+    uint16_t burst = this->rateLimit[commandClass].burst;
+    uint32_t refillTime = this->rateLimit[commandClass].refillTime;
+
+    if (bucket.tokens[commandClass] >= burst) {
+        bucket.tokens[commandClass] = burst;   // Full, the refill starts with the next request
+        bucket.refillStart[commandClass] = now;
+    } else {
+        uint32_t refill = (now - bucket.refillStart[commandClass]) / refillTime;
+
+        if (refill >= (uint32_t)(burst - bucket.tokens[commandClass])) {
+            bucket.tokens[commandClass] = burst;
+            bucket.refillStart[commandClass] = now;
+        } else if (refill > 0) {
+            bucket.tokens[commandClass] += refill;
+            bucket.refillStart[commandClass] += refill * refillTime;
+        }
+    }
+
+    if (bucket.tokens[commandClass] == 0) {
+        this->retryAfter = refillTime - (now - bucket.refillStart[commandClass]);
+
+        return false;
+    }
+
+    bucket.tokens[commandClass]--;
+
+    return true;
+}
+
+bool JSmartMeter238::bucketIdle(jsmClientBucket &bucket, uint32_t now) {
+    for (uint8_t i = 0; i < JSM_CLASSES; i++) {
+        uint16_t burst = this->rateLimit[i].burst;
+        uint32_t refillTime = this->rateLimit[i].refillTime;
+
+        if (burst == 0 || refillTime == 0 || bucket.tokens[i] >= burst) {
+            continue;
+        }
+
+        if ((now - bucket.refillStart[i]) / refillTime < (uint32_t)(burst - bucket.tokens[i])) {
+            return false;   // Still refilling
+        }
+    }
+
+    return true;
+}
+
+JSmartMeter238::jsmDataGroup JSmartMeter238::dataGroup(jsonCommands cmd) {
+    switch (cmd) {
+        case getPowerCutData:
+            return JSM_GROUP_POWER_CUT;
+        case getMeasurementData:
+            return JSM_GROUP_MEASUREMENT;
+        case getLimitData:
+        case getPurchaseData:
+            return JSM_GROUP_LIMIT_AND_PURCHASE;
+        case getPowerCompanyData:
+            return JSM_GROUP_POWER_COMPANY;
+        default:
+            return JSM_GROUPS;
+    }
+}
+
+JSmartMeter238::jsmDataGroup JSmartMeter238::updateGroup(jsonCommands cmd) {
+    switch (cmd) {
+        case setPowerCutData:
+        case setDelay:
+            return JSM_GROUP_POWER_CUT;
+        case setReset:
+            return JSM_GROUP_MEASUREMENT;
+        case setLimitsData:
+        case setPurchaseData:
+            return JSM_GROUP_LIMIT_AND_PURCHASE;
+        case setPowerCompanyData:
+            return JSM_GROUP_POWER_COMPANY;
+        default:
+            return this->dataGroup(cmd);
+    }
+}
+
+void JSmartMeter238::takeSnapshot() {
+    SmartMeter238::smartMeterData copy;
+
+    for (uint8_t group = 0; group < JSM_GROUPS; group++) {
+        bool copied = false;
+
+        for (uint8_t retry = 0; retry < JSM_SNAPSHOT_RETRIES && !copied; retry++) {
+            uint32_t sequence = this->dataSequence[group];
+
+            if (sequence & 1) {   // Update in progress, no yield: it can be called from SYS context
+                continue;
+            }
+
+            __sync_synchronize();
+
+            switch (group) {
+                case JSM_GROUP_POWER_CUT: {
+                    copy.powerCutData = this->jsonSmartMeterData->powerCutData;
+
+                    break;
+                }
+                case JSM_GROUP_MEASUREMENT: {
+                    copy.measurementData = this->jsonSmartMeterData->measurementData;
+
+                    break;
+                }
+                case JSM_GROUP_LIMIT_AND_PURCHASE: {
+                    copy.limitAndPurchaseData = this->jsonSmartMeterData->limitAndPurchaseData;
+
+                    break;
+                }
+                case JSM_GROUP_POWER_COMPANY: {
+                    copy.powerCompanyData = this->jsonSmartMeterData->powerCompanyData;
+
+                    break;
+                }
+            }
+
+            __sync_synchronize();
+
+            copied = this->dataSequence[group] == sequence;   // Changed while copying, retry
+        }
+
+        if (!copied) {
+            SM_PRINT_E_LN(F("* Group of smartMeterData in update, the last copy is used."));   // Writer stopped or too slow, stale data
+
+            continue;
+        }
+
+        switch (group) {
+            case JSM_GROUP_POWER_CUT: {
+                this->snapshot.powerCutData = copy.powerCutData;
+
+                break;
+            }
+            case JSM_GROUP_MEASUREMENT: {
+                this->snapshot.measurementData = copy.measurementData;
+
+                break;
+            }
+            case JSM_GROUP_LIMIT_AND_PURCHASE: {
+                this->snapshot.limitAndPurchaseData = copy.limitAndPurchaseData;
+
+                break;
+            }
+            case JSM_GROUP_POWER_COMPANY: {
+                this->snapshot.powerCompanyData = copy.powerCompanyData;
+
+                break;
+            }
+        }
+    }
+}
+
+bool JSmartMeter238::isCached(jsonCommands cmd) {
+    jsmDataGroup group = this->dataGroup(cmd);
+
+    if (!this->cacheEnabled || group == JSM_GROUPS || !this->acquiredValid[group]) {
+        return false;
+    }
+
+    return (millis() - this->acquiredTime[group]) < JSM_CACHE_TIME;
+}
+
+unsigned int JSmartMeter238::processEvents(char destination[]) {
+    if (this->jsonSmartMeterData == nullptr) {
+        SM_PRINT_E_LN(F("* Must call begin JSmartMeter238."));
+
+        return 0;
+    }
+
+    this->evaluateEvents();   // Data refreshed outside the library
+
+    if (this->eventPending == JSM_EVENT_NONE) {
+        return 0;
+    }
+
+    SM_PRINT_V(F("* Event state changed: "));
+    SM_PRINT_V_LN(this->eventPending);
+
+    this->eventReport = this->eventPending;
+    this->eventPending = JSM_EVENT_NONE;
+
+    unsigned int tmpLen = this->serializePayload(getEventData, "", "", destination);
+
+    this->eventReport = JSM_EVENT_ALL;
+
+    return tmpLen;
+}
+
+void JSmartMeter238::evaluateEvents() {
+    this->takeSnapshot();
+
+    uint8_t state = JSM_EVENT_NONE;
+
+    // Read by the library, or updated outside at least once (the sequence is only changed by beginUpdate / endUpdate)
+    if (this->acquiredValid[JSM_GROUP_MEASUREMENT] || this->dataSequence[JSM_GROUP_MEASUREMENT] >= 2) {
+        if (this->evaluateRule(this->eventState & JSM_EVENT_OVER_VOLTAGE, this->snapshot.measurementData.data.voltage, this->snapshot.limitAndPurchaseData.data.maxVoltageLimit, this->eventDeadbandVoltage, this->eventHysteresisVoltage, true)) {
+            state |= JSM_EVENT_OVER_VOLTAGE;
+        }
+
+        if (this->evaluateRule(this->eventState & JSM_EVENT_UNDER_VOLTAGE, this->snapshot.measurementData.data.voltage, this->snapshot.limitAndPurchaseData.data.minVoltageLimit, this->eventDeadbandVoltage, this->eventHysteresisVoltage, false)) {
+            state |= JSM_EVENT_UNDER_VOLTAGE;
+        }
+
+        if (this->evaluateRule(this->eventState & JSM_EVENT_OVER_CURRENT, this->snapshot.measurementData.data.current, this->snapshot.limitAndPurchaseData.data.maxCurrentLimit, this->eventDeadbandCurrent, this->eventHysteresisCurrent, true)) {
+            state |= JSM_EVENT_OVER_CURRENT;
+        }
+    } else {
+        // No measurement yet (voltage 0 is not under voltage) or the last read failed, keep the state
+        state |= this->eventState & (JSM_EVENT_OVER_VOLTAGE | JSM_EVENT_UNDER_VOLTAGE | JSM_EVENT_OVER_CURRENT);
+    }
+
+    if (this->snapshot.limitAndPurchaseData.data.energyPurchaseStatus) {
+        if (this->evaluateRule(this->eventState & JSM_EVENT_BALANCE_ALARM, this->snapshot.limitAndPurchaseData.data.energyPurchaseBalance, this->snapshot.limitAndPurchaseData.data.energyPurchaseAlarm, this->eventDeadbandBalance, this->eventHysteresisBalance, false)) {
+            state |= JSM_EVENT_BALANCE_ALARM;
+        }
+    }
+
+    if (this->snapshot.powerCutData.data.powerCut) {
+        state |= JSM_EVENT_POWER_CUT;
+    }
+
+    this->eventPending |= state ^ this->eventState;
+    this->eventState = state;
+}
+
+void JSmartMeter238::updateDerivedData() {
+    if (this->jsonSmartMeterData == nullptr) {
+        return;
+    }
+
+    this->takeSnapshot();
+
+    float activePower = this->snapshot.measurementData.data.activePower;
+    float reactivePower = this->snapshot.measurementData.data.reactivePower;
+
+    this->apparentPower = sqrt(activePower * activePower + reactivePower * reactivePower);
+    this->costRate = activePower * this->snapshot.powerCompanyData.data.priceKWh;   // Price per hour
+
+    // Exponential average
+    if (this->derivedSamples == 0) {
+        this->averagePower = activePower;
+    } else {
+        this->averagePower += JSM_DERIVED_EMA_ALPHA * (activePower - this->averagePower);
+    }
+
+    // Windowed average, running sum
+    if (this->derivedSamples >= JSM_DERIVED_WINDOW) {
+        this->windowSum -= this->derivedWindow[this->derivedIndex];
+    }
+
+    this->derivedWindow[this->derivedIndex] = activePower;
+    this->windowSum += activePower;
+
+    this->derivedIndex = (this->derivedIndex + 1) % JSM_DERIVED_WINDOW;
+    this->derivedSamples++;
+
+    uint8_t windowSamples = (this->derivedSamples < JSM_DERIVED_WINDOW) ? this->derivedSamples : JSM_DERIVED_WINDOW;
+
+    if (this->derivedIndex == 0) {
+        // Recompute once per window, avoid the float error of the running sum (amortized O(1))
+        this->windowSum = 0;
+
+        for (uint8_t i = 0; i < windowSamples; i++) {
+            this->windowSum += this->derivedWindow[i];
+        }
+    }
+
+    this->windowPower = this->windowSum / windowSamples;
+
+    // Peak demand, windowed average of a full window (not a single reading at start)
+    if (this->derivedSamples >= JSM_DERIVED_WINDOW && this->windowPower > this->peakDemand) {
+        this->peakDemand = this->windowPower;
+        this->peakDemandTime = millis();
+    }
+
+    // Time until the purchased energy runs out
+    this->balanceTime = -1;
+
+    if (this->snapshot.limitAndPurchaseData.data.energyPurchaseStatus && this->averagePower > 0) {
+        this->balanceTime = this->snapshot.limitAndPurchaseData.data.energyPurchaseBalance / this->averagePower;
+    }
+}
+
+void JSmartMeter238::resetDerivedData() {
+    this->derivedIndex = 0;
+    this->derivedSamples = 0;
+
+    this->windowSum = 0;
+    this->averagePower = 0;
+    this->windowPower = 0;
+    this->apparentPower = 0;
+    this->costRate = 0;
+    this->balanceTime = -1;
+
+    this->peakDemand = 0;
+    this->peakDemandTime = 0;
+}
+
+uint8_t JSmartMeter238::getEventState() {
+    return this->eventState;
+}
+
+void JSmartMeter238::setEventDeadband(float voltage, float current, float balance) {
+    this->eventDeadbandVoltage = voltage;
+    this->eventDeadbandCurrent = current;
+    this->eventDeadbandBalance = balance;
+}
+
+void JSmartMeter238::setEventHysteresis(float voltage, float current, float balance) {
+    this->eventHysteresisVoltage = voltage;
+    this->eventHysteresisCurrent = current;
+    this->eventHysteresisBalance = balance;
+}
+
+bool JSmartMeter238::evaluateRule(bool active, float value, float limit, float deadband, float hysteresis, bool upper) {
+    if (limit <= 0) {
+        return false;   // Limit not loaded from the meter (getLimitData) or disabled
+    }
+
+    if (upper) {
+        return active ? (value >= limit - hysteresis) : (value > limit + deadband);
+    }
+
+    return active ? (value <= limit + hysteresis) : (value < limit - deadband);
+}
+
+JSmartMeter238::jsonCommands JSmartMeter238::resolveCommand(const char *cmd) {
+    if (strcmp(cmd, this->strGetPowerCutData) == 0)
         return getPowerCutData;
     else if (strcmp(cmd, this->strGetMeasurementData) == 0)
         return getMeasurementData;
@@ -557,6 +1666,10 @@ JSmartMeter238::jsonCommands JSmartMeter238::resolveCommand(const char *cmd) {
         return getPurchaseData;
     else if (strcmp(cmd, this->strGetPowerCompanyData) == 0)
         return getPowerCompanyData;
+    else if (strcmp(cmd, this->strGetEventData) == 0)
+        return getEventData;
+    else if (strcmp(cmd, this->strGetDerivedData) == 0)
+        return getDerivedData;
     else if (strcmp(cmd, this->strSetLimitsData) == 0)
         return setLimitsData;
     else if (strcmp(cmd, this->strSetPurchaseData) == 0)
@@ -579,6 +1692,23 @@ JSmartMeter238::jsonCommands JSmartMeter238::resolveCommand(const char *cmd) {
     return invalidCmd;
 }
 
+JSmartMeter238::jsonCommands JSmartMeter238::resolveCommand(int cmd) {
+    if (cmd < 0 || cmd >= invalidCmd) {
+        return invalidCmd;
+    }
+
+    // Only the commands of this build (raw messages)
+    if (strlen(this->commandToText((jsonCommands)cmd)) == 0) {
+        return invalidCmd;
+    }
+
+    return (jsonCommands)cmd;
+}
+
+const char *JSmartMeter238::key(const char *full, const char *compact) {
+    return this->jsonCompact ? compact : full;
+}
+
 const char *JSmartMeter238::commandToText(jsonCommands cmd) {
     switch (cmd) {
         case getPowerCutData:
@@ -591,6 +1721,10 @@ const char *JSmartMeter238::commandToText(jsonCommands cmd) {
             return this->strGetPurchaseData;
         case getPowerCompanyData:
             return this->strGetPowerCompanyData;
+        case getEventData:
+            return this->strGetEventData;
+        case getDerivedData:
+            return this->strGetDerivedData;
         case setLimitsData:
             return this->strSetLimitsData;
         case setPurchaseData:
@@ -644,33 +1778,15 @@ void JSmartMeter238::clearErrCode() {
     this->errCode = JSM_ERR_NO_ERROR;
 }
 
-char *JSmartMeter238::getTypeStr(bool clear) {
-    const char *textTable = jsmStrTypeTable[this->getErrType(clear)];
-
-    uint8_t sizeString = strlen_P(textTable);
-
-    for (uint8_t i = 0; i < sizeString; i++) {
-        prtStrType[i] = pgm_read_byte_near(textTable + i);
-    }
-
-    prtStrType[sizeString] = 0;   // '\0'
-
-    return prtStrType;
+#ifdef JSM_ENABLE_PARSE_STATS
+JSmartMeter238::jsmParseStats JSmartMeter238::getParseStats(jsmInputClass inputClass) {
+    return this->parseStats[inputClass];
 }
 
-char *JSmartMeter238::getErrorStr(bool clear) {
-    const char *textTable = jsmStrErrTable[this->getErrCode(clear)];
-
-    uint8_t sizeString = strlen_P(textTable);
-
-    for (uint8_t i = 0; i < sizeString; i++) {
-        prtStrError[i] = pgm_read_byte_near(textTable + i);
-    }
-
-    prtStrError[sizeString] = 0;   // '\0'
-
-    return prtStrError;
+void JSmartMeter238::clearParseStats() {
+    memset(this->parseStats, 0, sizeof(this->parseStats));
 }
+#endif   // JSM_ENABLE_PARSE_STATS
 
 char *JSmartMeter238::round(float value, uint8_t decimalPlaces) {
     static char buf[16];
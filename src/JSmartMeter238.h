@@ -48,15 +48,67 @@ SOFTWARE.
 #define JSM_JSON_BUFFER 512
 #endif   // JSM_JSON_BUFFER
 
+#ifndef JSM_METER_TAG
+#define JSM_METER_TAG "jsm"   // Default meter tag for InfluxDB line protocol / OpenMetrics
+#endif   // JSM_METER_TAG
+
+#ifndef JSM_MAX_ID_LENGTH
+#define JSM_MAX_ID_LENGTH 24   // "id" of the request, echoed in the response
+#endif   // JSM_MAX_ID_LENGTH
+
+#ifndef JSM_QUEUE_SIZE
+#define JSM_QUEUE_SIZE 4   // Pipelined requests (queueCmdJson), each slot uses JSM_MAX_INPUT_LENGTH bytes
+#endif   // JSM_QUEUE_SIZE
+
+#ifndef JSM_CACHE_TIME
+#define JSM_CACHE_TIME 1000   // ms, queued get commands are served from the last read of the meter
+#endif   // JSM_CACHE_TIME
+
+#ifndef JSM_MAX_CLIENTS
+#define JSM_MAX_CLIENTS 4   // Clients with their own rate limit, the others share one
+#endif   // JSM_MAX_CLIENTS
+
+#ifndef JSM_DERIVED_WINDOW
+#define JSM_DERIVED_WINDOW 16   // Samples of the windowed average of active power (demand)
+#endif   // JSM_DERIVED_WINDOW
+
+#ifndef JSM_DERIVED_EMA_ALPHA
+#define JSM_DERIVED_EMA_ALPHA 0.1   // Weight of the last sample in the exponential average
+#endif   // JSM_DERIVED_EMA_ALPHA
+
+#ifndef JSM_SNAPSHOT_RETRIES
+#define JSM_SNAPSHOT_RETRIES 8   // Copies of a group in update before the last copy is used
+#endif   // JSM_SNAPSHOT_RETRIES
+
+#ifndef JSM_MAX_INPUT_LENGTH
+#define JSM_MAX_INPUT_LENGTH 256   // Longer requests are rejected before parse
+#endif   // JSM_MAX_INPUT_LENGTH
+
+#ifndef JSM_MAX_DEPTH
+#define JSM_MAX_DEPTH 2   // {"cmd":"...","data":{...}}
+#endif   // JSM_MAX_DEPTH
+
+#ifndef JSM_MAX_KEYS
+#define JSM_MAX_KEYS 12
+#endif   // JSM_MAX_KEYS
+
+#ifndef JSM_JSON_FILTER_BUFFER
+#define JSM_JSON_FILTER_BUFFER (JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(12))   // Top level keys and keys of "data" (with "hex")
+#endif   // JSM_JSON_FILTER_BUFFER
+
+#define JSM_JSON_HEADER_FILTER_BUFFER JSON_OBJECT_SIZE(4)   // "cmd", "id", "response" and "r"
+
 //------------------------------------------------------------------------------
 
 // Type error text
 const char jsmStrTypeNoError[] PROGMEM = {"No error type"};
 const char jsmStrTypeParse[] PROGMEM = {"Parse Json"};
+const char jsmStrTypeAdmission[] PROGMEM = {"Admission"};
 
 const char *const jsmStrTypeTable[] PROGMEM = {
 	jsmStrTypeNoError,
-	jsmStrTypeParse
+	jsmStrTypeParse,
+	jsmStrTypeAdmission
 };
 
 // Error text
@@ -73,6 +125,10 @@ const char jsmStrErrDataNotInJson[] PROGMEM = {"Data not present"};
 const char jsmStrErrDataNotValid[] PROGMEM = {"Data not valid"};
 const char jsmStrErrCommandNotInJson[] PROGMEM = {"Command is not present"};
 const char jsmStrErrCommandNotValid[] PROGMEM = {"Command not valid"};
+const char jsmStrErrInputTooLong[] PROGMEM = {"The input is too long"};
+const char jsmStrErrTooManyKeys[] PROGMEM = {"Too many keys in Json"};
+const char jsmStrErrRateLimited[] PROGMEM = {"Rate limit exceeded"};
+const char jsmStrErrIdNotValid[] PROGMEM = {"Id not valid"};
 
 const char *const jsmStrErrTable[] PROGMEM = {
 	jsmStrErrNoError,
@@ -85,34 +141,43 @@ const char *const jsmStrErrTable[] PROGMEM = {
 	jsmStrErrDataNotInJson,
 	jsmStrErrDataNotValid,
     jsmStrErrCommandNotInJson,	
-    jsmStrErrCommandNotValid
+    jsmStrErrCommandNotValid,
+    jsmStrErrInputTooLong,
+    jsmStrErrTooManyKeys,
+    jsmStrErrRateLimited,
+    jsmStrErrIdNotValid
 };
 
 class JSmartMeter238 {
    public:
+    // The values are the command codes of compact Json, do not change them. New commands at the end
     enum jsonCommands {
-        getPowerCutData,
-        getMeasurementData,
-        getLimitData,
-        getPurchaseData,
-        getPowerCompanyData,
-
-        setLimitsData,
-        setPurchaseData,
-        setPowerCutData,
-        setDelay,
-        setReset,
-        setPowerCompanyData,
+        getPowerCutData = 0,
+        getMeasurementData = 1,
+        getLimitData = 2,
+        getPurchaseData = 3,
+        getPowerCompanyData = 4,
+        getEventData = 5,
+
+        setLimitsData = 6,
+        setPurchaseData = 7,
+        setPowerCutData = 8,
+        setDelay = 9,
+        setReset = 10,
+        setPowerCompanyData = 11,
 #ifdef SM_ENABLE_RAW_TEST_MSG
-        getRawMessage,
-        sendRawMessage,
+        getRawMessage = 12,
+        sendRawMessage = 13,
 #endif
-        invalidCmd
+        getDerivedData = 14,
+
+        invalidCmd = 255   // Same code in every build
     };
 
     enum jsmErrorType {
         JSM_TYPE_NO_ERROR,
-        JSM_TYPE_PARSE_JSON
+        JSM_TYPE_PARSE_JSON,
+        JSM_TYPE_ADMISSION
     };
 
     enum jsmErrorCode {
@@ -126,7 +191,57 @@ class JSmartMeter238 {
         JSM_ERR_DATA_NOT_IN_JSON,     // Data not present
         JSM_ERR_DATA_NOT_VALID,       // Data not valid
         JSM_ERR_COMMAND_NOT_IN_JSON,  // Command not present	
-        JSM_ERR_COMMAND_NOT_VALID     // Commmand not valid
+        JSM_ERR_COMMAND_NOT_VALID,    // Commmand not valid
+        JSM_ERR_INPUT_TOO_LONG,       // Input longer than JSM_MAX_INPUT_LENGTH
+        JSM_ERR_TOO_MANY_KEYS,        // More keys than JSM_MAX_KEYS
+        JSM_ERR_RATE_LIMITED,         // Rate limit of the client exceeded, see "retryAfter"
+        JSM_ERR_ID_NOT_VALID          // "id" longer than JSM_MAX_ID_LENGTH - 1, or not a string or an integer (long)
+    };
+
+    enum jsmCommandClass {
+        JSM_CLASS_READ,    // get commands (InfluxDB / OpenMetrics output)
+        JSM_CLASS_WRITE,   // set commands (except setReset) and sendRawMessage
+        JSM_CLASS_RESET,   // setReset
+        JSM_CLASSES        // No class, not limited (getRawMessage)
+    };
+
+    enum jsmDataGroup {
+        JSM_GROUP_POWER_CUT,
+        JSM_GROUP_MEASUREMENT,
+        JSM_GROUP_LIMIT_AND_PURCHASE,
+        JSM_GROUP_POWER_COMPANY,
+        JSM_GROUPS   // No group
+    };
+
+    enum jsmOutputFormat {
+        JSM_FORMAT_JSON,
+        JSM_FORMAT_INFLUX,        // InfluxDB line protocol, get commands only
+        JSM_FORMAT_OPENMETRICS    // OpenMetrics text, get commands only
+    };
+
+#ifdef JSM_ENABLE_PARSE_STATS
+    enum jsmInputClass {
+        JSM_INPUT_VALID,              // Command processed (with or without meter error)
+        JSM_INPUT_REJECTED_EARLY,     // Rejected by the limits before parse
+        JSM_INPUT_INVALID_JSON,       // Rejected by the parser
+        JSM_INPUT_INVALID_COMMAND,    // Valid Json, command or data not valid
+        JSM_INPUT_CLASSES
+    };
+
+    struct jsmParseStats {
+        uint32_t count;
+        uint32_t worstMicros;
+    };
+#endif   // JSM_ENABLE_PARSE_STATS
+
+    enum jsmEvent {
+        JSM_EVENT_NONE = 0,
+        JSM_EVENT_OVER_VOLTAGE = 1 << 0,    // voltage > maxVoltageLimit
+        JSM_EVENT_UNDER_VOLTAGE = 1 << 1,   // voltage < minVoltageLimit
+        JSM_EVENT_OVER_CURRENT = 1 << 2,    // current > maxCurrentLimit
+        JSM_EVENT_BALANCE_ALARM = 1 << 3,   // energyPurchaseBalance < energyPurchaseAlarm
+        JSM_EVENT_POWER_CUT = 1 << 4,       // powerCut active
+        JSM_EVENT_ALL = 0x1F
     };
 
 #ifdef SM_ENABLE_DEBUG
@@ -142,33 +257,168 @@ class JSmartMeter238 {
     virtual ~JSmartMeter238();
 
     void setJsonPretty(bool set);
+    void setJsonCompact(bool set);   // Short keys and numeric codes, see README for the key map
+
+    void setOutputFormat(jsmOutputFormat format);
+    void setMeterTag(const char *tag);   // Must remain valid, no escape (avoid spaces, commas, '=' and '"')
 
     void begin(SmartMeter238::smartMeterData &smartMeterData);
 
-    unsigned int processCmd(jsonCommands cmd, char destination[], const char *jsonData, unsigned int jsonLength);
+    unsigned int processCmd(jsonCommands cmd, char destination[], const char *jsonData, unsigned int jsonLength, uint32_t clientId = 0);
     
-    unsigned int processCmdJson(char destination[], const char *jsonData, unsigned int jsonLength);
+    unsigned int processCmdJson(char destination[], const char *jsonData, unsigned int jsonLength, uint32_t clientId = 0);
+
+    // Token bucket for each client and command class: burst requests, then one each refillTime ms. burst = 0 no limit (default)
+    void setRateLimit(jsmCommandClass commandClass, uint16_t burst, uint32_t refillTime);
 
     jsonCommands resolveCommand(const char *cmd);
+    jsonCommands resolveCommand(int cmd);
+
+    // Writers of smartMeterData in another task or ISR must wrap each update of a group, the responses use a consistent copy
+    // Wrap only the copy of a local read into smartMeterData, not the meter transaction. One writer for each group: the library does not call them
+    // Inline for use in ISR, do not call process functions between them
+    inline void beginUpdate(jsmDataGroup group) {
+        this->dataSequence[group]++;   // Odd, update in progress
+        __sync_synchronize();
+    }
+
+    inline void endUpdate(jsmDataGroup group) {
+        __sync_synchronize();
+        this->dataSequence[group]++;   // Even, update done
+    }
+
+    // Pipelined requests, responses carry the "id" of the request and may complete out of order
+    // Json output only, false with InfluxDB / OpenMetrics (no "id")
+    bool queueCmdJson(const char *jsonData, unsigned int jsonLength, uint32_t clientId = 0);
+    unsigned int processQueue(char destination[]);   // Process one request, return 0 if the queue is empty
+    uint8_t queueCount();
+
+#ifdef JSM_ENABLE_PARSE_STATS
+    // Worst-case processing time of processCmdJson per input class
+    jsmParseStats getParseStats(jsmInputClass inputClass);
+    void clearParseStats();
+#endif   // JSM_ENABLE_PARSE_STATS
+
+    // Event engine, the rules are evaluated with each read of the meter (and in processEvents for data refreshed outside the library)
+    // processEvents sends the conditions changed since the last call. Return 0 if no condition changed
+    unsigned int processEvents(char destination[]);
+
+    uint8_t getEventState();
+
+    // Derived data, updated once per sample. Called by getMeasurementData, call it if smartMeterData is refreshed outside the library
+    void updateDerivedData();
+    void resetDerivedData();
+
+    // Deadband: margin beyond the limit to trigger. Hysteresis: margin inside the limit to clear
+    void setEventDeadband(float voltage, float current, float balance);
+    void setEventHysteresis(float voltage, float current, float balance);
 
    private:
     bool jsonPretty = false;
+    bool jsonCompact = false;
+
+    const char *key(const char *full, const char *compact);
+
+    jsmOutputFormat outputFormat = JSM_FORMAT_JSON;
+    const char *meterTag = JSM_METER_TAG;
 
     SmartMeter238::smartMeterData *jsonSmartMeterData;
+    SmartMeter238::smartMeterData snapshot;   // Copy used by serialize and events
+
+    volatile uint32_t dataSequence[JSM_GROUPS] = {};   // Seqlock for each group
+
+    void takeSnapshot();
+    jsmDataGroup updateGroup(jsonCommands cmd);
 
     jsmErrorType errType = JSM_TYPE_NO_ERROR;
     jsmErrorCode errCode = JSM_ERR_NO_ERROR;
 
     char *round(float value, uint8_t decimalPlaces);
 
-    char prtStrType[SM_MAX_STR_LENGTH_TYPE];
-    char prtStrError[SM_MAX_STR_LENGTH_ERROR];
+    char requestId[JSM_MAX_ID_LENGTH] = "";
+    bool requestIdIsNumber = false;
+
+    bool captureRequestId();   // false if the "id" cannot be echoed unchanged
+
+    struct jsmQueueSlot {
+        char json[JSM_MAX_INPUT_LENGTH + 1];
+        unsigned int length;
+        jsonCommands cmd;
+        uint32_t clientId;
+        uint32_t order;
+        bool used;
+    };
+
+    jsmQueueSlot queue[JSM_QUEUE_SIZE] = {};
+    uint32_t queueOrder = 0;
+
+    bool cacheEnabled = false;
+    uint32_t acquiredTime[JSM_GROUPS];
+    bool acquiredValid[JSM_GROUPS] = {};
+
+    jsmDataGroup dataGroup(jsonCommands cmd);
+    bool isCached(jsonCommands cmd);
+
+    struct jsmRateLimit {
+        uint16_t burst;
+        uint32_t refillTime;
+    };
+
+    struct jsmClientBucket {
+        uint32_t clientId;
+        uint16_t tokens[JSM_CLASSES];
+        uint32_t refillStart[JSM_CLASSES];
+        bool used;
+    };
+
+    jsmRateLimit rateLimit[JSM_CLASSES] = {};
+    jsmClientBucket clientBucket[JSM_MAX_CLIENTS] = {};
+    jsmClientBucket sharedBucket = {};   // Clients without slot
+
+    uint32_t retryAfter = 0;
+
+    jsmCommandClass commandClass(jsonCommands cmd);
+    bool admitCommand(jsonCommands cmd, uint32_t clientId);
+    bool bucketIdle(jsmClientBucket &bucket, uint32_t now);
+
+    static_assert(JSM_DERIVED_WINDOW > 0 && JSM_DERIVED_WINDOW <= 255, "JSM_DERIVED_WINDOW must be 1 to 255 (uint8_t index)");
+
+    float derivedWindow[JSM_DERIVED_WINDOW];
+    uint8_t derivedIndex = 0;
+    uint32_t derivedSamples = 0;
+
+    float windowSum = 0;
+    float averagePower = 0;   // Exponential
+    float windowPower = 0;    // Windowed
+    float apparentPower = 0;
+    float costRate = 0;
+    float balanceTime = -1;   // Hours, -1 unknown
+
+    float peakDemand = 0;
+    uint32_t peakDemandTime = 0;
+
+    uint8_t eventState = JSM_EVENT_NONE;
+    uint8_t eventReport = JSM_EVENT_ALL;
+    uint8_t eventPending = JSM_EVENT_NONE;   // Changed, not sent yet
+
+    float eventDeadbandVoltage = 0;
+    float eventDeadbandCurrent = 0;
+    float eventDeadbandBalance = 0;
+
+    float eventHysteresisVoltage = 0;
+    float eventHysteresisCurrent = 0;
+    float eventHysteresisBalance = 0;
+
+    void evaluateEvents();
+    bool evaluateRule(bool active, float value, float limit, float deadband, float hysteresis, bool upper);
 
     const char *strGetPowerCutData = "getPowerCutData";
     const char *strGetMeasurementData = "getMeasurementData";
     const char *strGetLimitData = "getLimitData";
     const char *strGetPurchaseData = "getPurchaseData";
     const char *strGetPowerCompanyData = "getPowerCompanyData";
+    const char *strGetEventData = "getEventData";
+    const char *strGetDerivedData = "getDerivedData";
 
     const char *strSetLimitsData = "setLimitsData";
     const char *strSetPurchaseData = "setPurchaseData";
@@ -182,9 +432,24 @@ class JSmartMeter238 {
 #endif
     const char *strInvalid = "commandInvalid";
 
-    bool deserializePayload(const char *jsonData, unsigned int jsonLength);
+    bool deserializePayload(const char *jsonData, unsigned int jsonLength, bool header = false, bool checked = false);   // checked: checkPayload already done
+    bool checkPayload(const char *jsonData, unsigned int jsonLength);
+    bool responseInJson = false;   // Set by checkPayload
+
+#ifdef JSM_ENABLE_PARSE_STATS
+    jsmParseStats parseStats[JSM_INPUT_CLASSES];
+#endif   // JSM_ENABLE_PARSE_STATS
 
     unsigned int serializePayload(jsonCommands cmd, const char *strErrType, const char *strErrDescription, char destination[]);
+    unsigned int serializeRejection(jsonCommands cmd, char destination[]);
+    void serializeHeader(jsonCommands cmd);
+
+    unsigned int serializeMetrics(jsonCommands cmd, char destination[]);
+
+    bool writeMetric(char destination[], unsigned int &len, const char *name, const char *value);
+    bool writeMetric(char destination[], unsigned int &len, const char *name, float value);
+    bool writeMetric(char destination[], unsigned int &len, const char *name, bool value);
+    bool writeMetricText(char destination[], unsigned int &len, const char *name, const char *value);
 
     const char *commandToText(jsonCommands cmd);
 
@@ -196,9 +461,6 @@ class JSmartMeter238 {
     void clearErrType();
     void clearErrCode();
 
-    char *getTypeStr(bool clear = false);
-    char *getErrorStr(bool clear = false);
-
     SmartMeter238 &smEnergyMeter;
 
 #ifdef SM_ENABLE_DEBUG
@@ -210,5 +472,7 @@ class JSmartMeter238 {
 #endif   // SM_ENABLE_DEBUG
 
     StaticJsonDocument<JSM_JSON_BUFFER> doc;
+    StaticJsonDocument<JSM_JSON_FILTER_BUFFER> filter;   // Known keys, the others are skipped by the parser
+    StaticJsonDocument<JSM_JSON_HEADER_FILTER_BUFFER> headerFilter;   // Without "data", for the admission before parse the data
 };
 #endif   // JSmartMeter238_h
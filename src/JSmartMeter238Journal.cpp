@@ -0,0 +1,510 @@
+/*
+Append-only journal for the SmartMeter238 energy readings.
+Storage via LittleFS (or any fs::FS) on esp8266, stdio files on host builds.
+2020 (development with PlatformIO IDE for VSCode & esp8266 core)
+
+MIT License
+
+Copyright (c) 2020 Rodrigo González
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//------------------------------------------------------------------------------
+
+#include "JSmartMeter238Journal.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+
+#ifdef ARDUINO
+JSmartMeter238Journal::JSmartMeter238Journal(fs::FS &fs, const char *dir) : journalFs(fs), journalDir(dir) {}
+#else
+JSmartMeter238Journal::JSmartMeter238Journal(const char *dir) : journalDir(dir) {}
+#endif   // ARDUINO
+
+JSmartMeter238Journal::~JSmartMeter238Journal() {
+    this->flush();
+}
+
+bool JSmartMeter238Journal::begin() {
+    this->activeSegment = 0;
+    this->nextSequence = 0;
+    this->lastTime = 0;
+    this->batchCount = 0;
+
+    bool clean[JSM_JOURNAL_SEGMENTS];
+
+    for (uint8_t i = 0; i < JSM_JOURNAL_SEGMENTS; i++) {
+        clean[i] = this->loadSegment(i);
+
+        if (this->segmentCount[i] > 0 && this->segmentFirstSequence[i] >= this->segmentFirstSequence[this->activeSegment]) {
+            this->activeSegment = i;
+        }
+    }
+
+    uint8_t active = this->activeSegment;
+
+    if (this->segmentCount[active] > 0) {
+        journalRecord record;
+
+        if (!this->readRecord(active, this->segmentCount[active] - 1, record)) {
+            return false;
+        }
+
+        this->nextSequence = record.sequence + 1;
+        this->lastTime = record.time;
+    }
+
+    // A torn write (power loss) leaves a partial or invalid record at the tail, cut it and continue in the same segment
+    if (!clean[active] || this->storageSize(active) != this->segmentCount[active] * sizeof(journalRecord)) {
+        return this->storageTruncate(active, this->segmentCount[active] * sizeof(journalRecord));
+    }
+
+    return true;
+}
+
+bool JSmartMeter238Journal::append(journalRecord &record) {
+    if (record.time < this->lastTime) {
+        return false;   // The index needs time in order
+    }
+
+    if (this->batchCount >= JSM_JOURNAL_BATCH && !this->flush()) {
+        return false;   // Storage not available, keep the batch
+    }
+
+    record.sequence = this->nextSequence++;
+    record.magic = this->recordMagic;
+    record.crc = this->crc16((const uint8_t *)&record, offsetof(journalRecord, crc));
+
+    this->lastTime = record.time;
+
+    this->batch[this->batchCount++] = record;
+
+    if (this->batchCount >= JSM_JOURNAL_BATCH) {
+        this->flush();   // On error retried by the next append
+    }
+
+    return true;
+}
+
+bool JSmartMeter238Journal::flush() {
+    uint8_t written = 0;
+    bool ok = true;
+
+    while (written < this->batchCount) {
+        uint8_t active = this->activeSegment;
+
+        if (this->segmentCount[active] >= JSM_JOURNAL_SEGMENT_RECORDS) {
+            if (!this->rotateSegment()) {
+                ok = false;
+
+                break;
+            }
+
+            continue;
+        }
+
+        uint32_t room = JSM_JOURNAL_SEGMENT_RECORDS - this->segmentCount[active];
+        uint8_t len = this->batchCount - written;
+
+        if (len > room) {
+            len = room;
+        }
+
+        if (!this->storageAppend(active, (const uint8_t *)&this->batch[written], len * sizeof(journalRecord))) {
+            this->storageTruncate(active, this->segmentCount[active] * sizeof(journalRecord));   // Cut a partial write, the records must stay aligned
+
+            ok = false;
+
+            break;
+        }
+
+        if (this->segmentCount[active] == 0) {
+            this->segmentFirstTime[active] = this->batch[written].time;
+            this->segmentFirstSequence[active] = this->batch[written].sequence;
+        }
+
+        this->segmentCount[active] += len;
+        this->segmentLastTime[active] = this->batch[written + len - 1].time;
+
+        written += len;
+    }
+
+    // Drop the records written, the others are kept for the next flush
+    memmove(this->batch, &this->batch[written], (this->batchCount - written) * sizeof(journalRecord));
+    this->batchCount -= written;
+
+    return ok;
+}
+
+bool JSmartMeter238Journal::last(journalRecord &record) {
+    if (this->batchCount > 0) {
+        record = this->batch[this->batchCount - 1];
+
+        return true;
+    }
+
+    uint8_t active = this->activeSegment;
+
+    if (this->segmentCount[active] == 0) {
+        // Just rotated, the last record is at the end of the previous segment
+        active = (active + JSM_JOURNAL_SEGMENTS - 1) % JSM_JOURNAL_SEGMENTS;
+
+        if (this->segmentCount[active] == 0) {
+            return false;
+        }
+    }
+
+    return this->readRecord(active, this->segmentCount[active] - 1, record);
+}
+
+bool JSmartMeter238Journal::find(uint32_t time, journalRecord &record) {
+    return this->read(time, UINT32_MAX, &record, 1) == 1;
+}
+
+unsigned int JSmartMeter238Journal::read(uint32_t from, uint32_t to, journalRecord records[], unsigned int maxRecords) {
+    unsigned int total = 0;
+
+    // Segments from the oldest to the active one
+    for (uint8_t n = 1; n <= JSM_JOURNAL_SEGMENTS && total < maxRecords; n++) {
+        uint8_t segment = (this->activeSegment + n) % JSM_JOURNAL_SEGMENTS;
+
+        if (this->segmentCount[segment] == 0 || this->segmentLastTime[segment] < from) {
+            continue;
+        }
+
+        if (this->segmentFirstTime[segment] > to) {
+            return total;
+        }
+
+        for (uint32_t i = this->lowerBound(segment, from); i < this->segmentCount[segment] && total < maxRecords; i++) {
+            if (!this->readRecord(segment, i, records[total])) {
+                return total;
+            }
+
+            if (records[total].time > to) {
+                return total;
+            }
+
+            total++;
+        }
+    }
+
+    for (uint8_t i = 0; i < this->batchCount && total < maxRecords; i++) {
+        if (this->batch[i].time >= from && this->batch[i].time <= to) {
+            records[total++] = this->batch[i];
+        }
+    }
+
+    return total;
+}
+
+uint32_t JSmartMeter238Journal::count() {
+    uint32_t total = this->batchCount;
+
+    for (uint8_t i = 0; i < JSM_JOURNAL_SEGMENTS; i++) {
+        total += this->segmentCount[i];
+    }
+
+    return total;
+}
+
+#ifdef ARDUINO
+bool JSmartMeter238Journal::append(SmartMeter238::smartMeterData &smartMeterData, uint32_t time) {
+    journalRecord record;
+
+    record.time = time;
+
+    record.totalKWh = smartMeterData.measurementData.data.totalKWh;
+    record.lapseOfTimeTotalEnergy = smartMeterData.measurementData.data.lapseOfTimeTotalEnergy;
+    record.lapseOfTimeImportEnergy = smartMeterData.measurementData.data.lapseOfTimeImportEnergy;
+    record.lapseOfTimeExportEnergy = smartMeterData.measurementData.data.lapseOfTimeExportEnergy;
+    record.lapseOfTimePriceEnergy = smartMeterData.measurementData.data.lapseOfTimePriceEnergy;
+
+    record.voltage = smartMeterData.measurementData.data.voltage;
+    record.current = smartMeterData.measurementData.data.current;
+    record.activePower = smartMeterData.measurementData.data.activePower;
+
+    return this->append(record);
+}
+
+bool JSmartMeter238Journal::restore(SmartMeter238::smartMeterData &smartMeterData) {
+    journalRecord record;
+
+    if (!this->last(record)) {
+        return false;
+    }
+
+    smartMeterData.measurementData.data.totalKWh = record.totalKWh;
+    smartMeterData.measurementData.data.lapseOfTimeTotalEnergy = record.lapseOfTimeTotalEnergy;
+    smartMeterData.measurementData.data.lapseOfTimeImportEnergy = record.lapseOfTimeImportEnergy;
+    smartMeterData.measurementData.data.lapseOfTimeExportEnergy = record.lapseOfTimeExportEnergy;
+    smartMeterData.measurementData.data.lapseOfTimePriceEnergy = record.lapseOfTimePriceEnergy;
+
+    smartMeterData.measurementData.data.voltage = record.voltage;
+    smartMeterData.measurementData.data.current = record.current;
+    smartMeterData.measurementData.data.activePower = record.activePower;
+
+    return true;
+}
+#endif   // ARDUINO
+
+char *JSmartMeter238Journal::segmentPath(uint8_t segment) {
+    snprintf(this->pathBuffer, JSM_JOURNAL_PATH_LENGTH, "%s/jsm%u.bin", this->journalDir, segment);
+
+    return this->pathBuffer;
+}
+
+bool JSmartMeter238Journal::loadSegment(uint8_t segment) {
+    this->segmentCount[segment] = this->storageSize(segment) / sizeof(journalRecord);
+    this->segmentFirstTime[segment] = 0;
+    this->segmentLastTime[segment] = 0;
+    this->segmentFirstSequence[segment] = 0;
+
+    uint32_t validCount = this->segmentCount[segment];
+
+    journalRecord record;
+
+    // Drop invalid records at the tail (power loss in the middle of a batch)
+    while (validCount > 0 && !this->readRecord(segment, validCount - 1, record)) {
+        validCount--;
+    }
+
+    bool clean = validCount == this->segmentCount[segment];
+
+    this->segmentCount[segment] = validCount;
+
+    if (validCount == 0) {
+        return clean;
+    }
+
+    this->segmentLastTime[segment] = record.time;
+
+    if (!this->readRecord(segment, 0, record)) {
+        this->segmentCount[segment] = 0;
+
+        return false;
+    }
+
+    this->segmentFirstTime[segment] = record.time;
+    this->segmentFirstSequence[segment] = record.sequence;
+
+    return clean;
+}
+
+bool JSmartMeter238Journal::rotateSegment() {
+    uint8_t next = (this->activeSegment + 1) % JSM_JOURNAL_SEGMENTS;
+
+    // The oldest segment is removed first, if it fails the index still describes the file and the next flush retries
+    if (!this->storageRemove(next)) {
+        return false;
+    }
+
+    this->activeSegment = next;
+
+    this->segmentCount[this->activeSegment] = 0;
+    this->segmentFirstTime[this->activeSegment] = 0;
+    this->segmentLastTime[this->activeSegment] = 0;
+    this->segmentFirstSequence[this->activeSegment] = 0;
+
+    return true;
+}
+
+bool JSmartMeter238Journal::readRecord(uint8_t segment, uint32_t index, journalRecord &record) {
+    if (!this->storageRead(segment, index * sizeof(journalRecord), (uint8_t *)&record, sizeof(journalRecord))) {
+        return false;
+    }
+
+    return this->validRecord(record);
+}
+
+bool JSmartMeter238Journal::validRecord(const journalRecord &record) {
+    return record.magic == this->recordMagic && record.crc == this->crc16((const uint8_t *)&record, offsetof(journalRecord, crc));
+}
+
+uint32_t JSmartMeter238Journal::lowerBound(uint8_t segment, uint32_t time) {
+    uint32_t low = 0;
+    uint32_t high = this->segmentCount[segment];
+
+    journalRecord record;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (!this->readRecord(segment, mid, record)) {
+            return high;
+        }
+
+        if (record.time < time) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+uint16_t JSmartMeter238Journal::crc16(const uint8_t *buf, size_t len) {
+    uint16_t crc = 0xFFFF;   // CRC-16/CCITT-FALSE
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)buf[i] << 8;
+
+        for (uint8_t j = 0; j < 8; j++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+#ifdef ARDUINO
+size_t JSmartMeter238Journal::storageSize(uint8_t segment) {
+    File file = this->journalFs.open(this->segmentPath(segment), "r");
+
+    if (!file) {
+        return 0;
+    }
+
+    size_t size = file.size();
+
+    file.close();
+
+    return size;
+}
+
+bool JSmartMeter238Journal::storageRead(uint8_t segment, size_t offset, uint8_t *buf, size_t len) {
+    File file = this->journalFs.open(this->segmentPath(segment), "r");
+
+    if (!file) {
+        return false;
+    }
+
+    bool ok = file.seek(offset, SeekSet) && file.read(buf, len) == len;
+
+    file.close();
+
+    return ok;
+}
+
+bool JSmartMeter238Journal::storageAppend(uint8_t segment, const uint8_t *buf, size_t len) {
+    File file = this->journalFs.open(this->segmentPath(segment), "a");
+
+    if (!file) {
+        return false;
+    }
+
+    bool ok = file.write(buf, len) == len;
+
+    file.close();
+
+    return ok;
+}
+
+bool JSmartMeter238Journal::storageRemove(uint8_t segment) {
+    const char *path = this->segmentPath(segment);
+
+    return !this->journalFs.exists(path) || this->journalFs.remove(path);
+}
+
+bool JSmartMeter238Journal::storageTruncate(uint8_t segment, size_t size) {
+    if (size == 0) {
+        return this->storageRemove(segment);
+    }
+
+    File file = this->journalFs.open(this->segmentPath(segment), "r+");
+
+    if (!file) {
+        return false;
+    }
+
+    bool ok = file.truncate(size);
+
+    file.close();
+
+    return ok;
+}
+#else   // ARDUINO
+size_t JSmartMeter238Journal::storageSize(uint8_t segment) {
+    FILE *file = fopen(this->segmentPath(segment), "rb");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    long size = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : 0;
+
+    fclose(file);
+
+    return size > 0 ? (size_t)size : 0;
+}
+
+bool JSmartMeter238Journal::storageRead(uint8_t segment, size_t offset, uint8_t *buf, size_t len) {
+    FILE *file = fopen(this->segmentPath(segment), "rb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    bool ok = fseek(file, (long)offset, SEEK_SET) == 0 && fread(buf, 1, len, file) == len;
+
+    fclose(file);
+
+    return ok;
+}
+
+bool JSmartMeter238Journal::storageAppend(uint8_t segment, const uint8_t *buf, size_t len) {
+    FILE *file = fopen(this->segmentPath(segment), "ab");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    bool ok = fwrite(buf, 1, len, file) == len;
+
+    ok = (fclose(file) == 0) && ok;
+
+    return ok;
+}
+
+bool JSmartMeter238Journal::storageRemove(uint8_t segment) {
+    const char *path = this->segmentPath(segment);
+
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return true;
+    }
+
+    fclose(file);
+
+    return remove(path) == 0;
+}
+
+bool JSmartMeter238Journal::storageTruncate(uint8_t segment, size_t size) {
+    if (size == 0) {
+        return this->storageRemove(segment);
+    }
+
+    return truncate(this->segmentPath(segment), (off_t)size) == 0;
+}
+#endif   // ARDUINO
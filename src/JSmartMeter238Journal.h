@@ -0,0 +1,150 @@
+/*
+Append-only journal for the SmartMeter238 energy readings.
+Storage via LittleFS (or any fs::FS) on esp8266, stdio files on host builds.
+2020 (development with PlatformIO IDE for VSCode & esp8266 core)
+
+MIT License
+
+Copyright (c) 2020 Rodrigo González
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//------------------------------------------------------------------------------
+#ifndef JSmartMeter238Journal_h
+#define JSmartMeter238Journal_h
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <FS.h>              // LittleFS / SPIFFS
+#include <SmartMeter238.h>   // For reading DDS238-4 W Wifi Smart meter (SM)
+#else
+#include <stdio.h>    // Host build, file-backed stand-in
+#include <unistd.h>   // truncate
+#endif   // ARDUINO
+
+//------------------------------------------------------------------------------
+// DEFAULTS
+//------------------------------------------------------------------------------
+
+#ifndef JSM_JOURNAL_SEGMENTS
+#define JSM_JOURNAL_SEGMENTS 4   // Files used as a ring, the oldest is removed when all are full
+#endif   // JSM_JOURNAL_SEGMENTS
+
+#ifndef JSM_JOURNAL_SEGMENT_RECORDS
+#define JSM_JOURNAL_SEGMENT_RECORDS 1024   // 44 bytes per record
+#endif   // JSM_JOURNAL_SEGMENT_RECORDS
+
+#ifndef JSM_JOURNAL_BATCH
+#define JSM_JOURNAL_BATCH 8   // Records kept in RAM before each write to flash
+#endif   // JSM_JOURNAL_BATCH
+
+#ifndef JSM_JOURNAL_PATH_LENGTH
+#define JSM_JOURNAL_PATH_LENGTH 32
+#endif   // JSM_JOURNAL_PATH_LENGTH
+
+//------------------------------------------------------------------------------
+
+class JSmartMeter238Journal {
+   public:
+    struct journalRecord {
+        uint32_t sequence;   // Set by append
+        uint32_t time;       // Time given by the user (epoch), must not decrease
+
+        float totalKWh;
+        float lapseOfTimeTotalEnergy;
+        float lapseOfTimeImportEnergy;
+        float lapseOfTimeExportEnergy;
+        float lapseOfTimePriceEnergy;
+
+        float voltage;
+        float current;
+        float activePower;
+
+        uint16_t magic;
+        uint16_t crc;   // Set by append
+    } __attribute__((packed));
+
+#ifdef ARDUINO
+    JSmartMeter238Journal(fs::FS &fs, const char *dir);
+#else
+    JSmartMeter238Journal(const char *dir);
+#endif   // ARDUINO
+
+    virtual ~JSmartMeter238Journal();
+
+    bool begin();   // Recover the index, reads only the head of each segment and the tail of the active one
+
+    bool append(journalRecord &record);   // false if the record is not added (time out of order, or batch full and the storage fails)
+    bool flush();                         // On error the records not written are kept for the next flush
+
+    bool last(journalRecord &record);
+    bool find(uint32_t time, journalRecord &record);   // First record with record.time >= time
+    unsigned int read(uint32_t from, uint32_t to, journalRecord records[], unsigned int maxRecords);
+
+    uint32_t count();
+
+#ifdef ARDUINO
+    bool append(SmartMeter238::smartMeterData &smartMeterData, uint32_t time);
+    bool restore(SmartMeter238::smartMeterData &smartMeterData);   // Load the last record in measurementData
+#endif   // ARDUINO
+
+   private:
+#ifdef ARDUINO
+    fs::FS &journalFs;
+#endif   // ARDUINO
+    const char *journalDir;
+
+    uint32_t segmentCount[JSM_JOURNAL_SEGMENTS] = {};
+    uint32_t segmentFirstTime[JSM_JOURNAL_SEGMENTS] = {};
+    uint32_t segmentLastTime[JSM_JOURNAL_SEGMENTS] = {};
+    uint32_t segmentFirstSequence[JSM_JOURNAL_SEGMENTS] = {};
+
+    uint8_t activeSegment = 0;
+    uint32_t nextSequence = 0;
+    uint32_t lastTime = 0;
+
+    journalRecord batch[JSM_JOURNAL_BATCH];
+    uint8_t batchCount = 0;
+
+    const uint16_t recordMagic = 0x4A38;   // "J8"
+
+    char *segmentPath(uint8_t segment);
+    char pathBuffer[JSM_JOURNAL_PATH_LENGTH];
+
+    bool loadSegment(uint8_t segment);
+    bool rotateSegment();
+
+    bool readRecord(uint8_t segment, uint32_t index, journalRecord &record);
+    bool validRecord(const journalRecord &record);
+    uint32_t lowerBound(uint8_t segment, uint32_t time);
+
+    uint16_t crc16(const uint8_t *buf, size_t len);
+
+    size_t storageSize(uint8_t segment);
+    bool storageRead(uint8_t segment, size_t offset, uint8_t *buf, size_t len);
+    bool storageAppend(uint8_t segment, const uint8_t *buf, size_t len);
+    bool storageRemove(uint8_t segment);
+    bool storageTruncate(uint8_t segment, size_t size);
+};
+#endif   // JSmartMeter238Journal_h